@@ -31,8 +31,28 @@
  */
 #define  PIN_LED  13
 
+/*
+ * For a gang board, build with PIC_TARGETS set to the number of PICs,
+ * up to 6.  They share ICSPCLK and MCLR, and each has its own ICSPDAT:
+ * target 0 on A0, target 1 on A1 and so on, which are PORTC bits 0 to
+ * 5 on an Uno.  Every bit then goes to all of them with one port write
+ * and comes back from all of them with one port read.  The same image
+ * goes to every target, and each read answers with a word from each
+ * of them, so the host can tell which ones are good.
+ */
+#ifndef PIC_TARGETS
+#define  PIC_TARGETS  1
+#endif
+#if PIC_TARGETS > 6
+#error "no more than 6 targets, one for each bit of PORTC"
+#endif
+
 #define  PIN_PIC_ICSPCLK  3    // this is pin 6 on the PIC
+#if PIC_TARGETS > 1
+#define  PIN_PIC_ICSPDAT  A0   // target 0's, pin 7 on the PIC
+#else
 #define  PIN_PIC_ICSPDAT  5    // this is pin 7 on the PIC
+#endif
 #define  PIN_PIC_MCLR     7    // this is pin 4 on the PIC
 
 /*
@@ -40,20 +60,102 @@
  * and PIC pin 8 is VSS (gnd)
  */
 
+/*
+ * The clock and data pins are driven through the port registers,
+ * because digitalWrite() and digitalRead() take several microseconds
+ * each.  On an Uno (ATmega328P) pins 0 to 7 are PORTD bits 0 to 7, so
+ * the masks follow from the pin numbers.  Other boards fall back to
+ * digitalWrite().
+ */
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+#define  ICSP_PORT  PORTD
+#define  ICSP_CLK   _BV(PIN_PIC_ICSPCLK)
+#if PIC_TARGETS > 1
+#define  DAT_PORT   PORTC
+#define  DAT_DDR    DDRC
+#define  DAT_PIN    PINC
+#define  ICSP_DAT   ((1 << PIC_TARGETS) - 1)
+#define  DAT_BIT(t)  _BV(t)
+#else
+#define  DAT_PORT   PORTD
+#define  DAT_DDR    DDRD
+#define  DAT_PIN    PIND
+#define  ICSP_DAT   _BV(PIN_PIC_ICSPDAT)
+#define  DAT_BIT(t)  ICSP_DAT
+#endif
+
+#define  CLK_HIGH()    (ICSP_PORT |= ICSP_CLK)
+#define  CLK_LOW()     (ICSP_PORT &= ~ICSP_CLK)
+#define  DAT_HIGH()    (DAT_PORT |= ICSP_DAT)
+#define  DAT_LOW()     (DAT_PORT &= ~ICSP_DAT)
+#define  DAT_READ()    (DAT_PIN & ICSP_DAT)  // every target's bit
+#define  DAT_OUTPUT()  (DAT_DDR |= ICSP_DAT)
+#define  DAT_INPUT()   (DAT_LOW(), DAT_DDR &= ~ICSP_DAT)  // no pull-up
+#define  ICSP_DELAY(ns)  __builtin_avr_delay_cycles(NS_CYCLES(ns))
+#else
+#if PIC_TARGETS > 1
+#error "more than one target needs the port registers of an Uno"
+#endif
+#define  CLK_HIGH()    digitalWrite(PIN_PIC_ICSPCLK, HIGH)
+#define  CLK_LOW()     digitalWrite(PIN_PIC_ICSPCLK, LOW)
+#define  DAT_HIGH()    digitalWrite(PIN_PIC_ICSPDAT, HIGH)
+#define  DAT_LOW()     digitalWrite(PIN_PIC_ICSPDAT, LOW)
+#define  DAT_READ()    digitalRead(PIN_PIC_ICSPDAT)
+#define  DAT_BIT(t)    HIGH
+#define  DAT_OUTPUT()  pinMode(PIN_PIC_ICSPDAT, OUTPUT)
+#define  DAT_INPUT()   pinMode(PIN_PIC_ICSPDAT, INPUT)
+#define  ICSP_DELAY(ns)  delayMicroseconds(((ns) + 999) / 1000)
+#endif
+
+/*
+ * ICSP timing for the target PIC, fixed at build time.  For the
+ * 12F1822 (DS41390): clock high and low at least 100 ns each, and
+ * 1 us from the last clock of a command to the first of its data.
+ * The delays come on top of the instructions that move the pins, so
+ * they are a little long.  simavr can check them: run the sketch
+ * there with a VCD trace of PORTD and measure the edges.
+ */
+#define  PIC_TCK_NS   100
+#define  PIC_TDLY_NS  1000
+
+/*
+ * A data EEPROM byte is erased and written in at most 5 ms (TDEW in
+ * the 12F1822 data sheet).
+ */
+#define  PIC_TDEW_MS  5
+
+#define  NS_CYCLES(ns)  (((ns) * (F_CPU / 1000000UL) + 999) / 1000)
+
 /*
  * Protocol:
  * The host sends commands.  The arduino responds. All commands are 1 letter.
  * Some commands have a parameter.  Parameters are hex numbers terminated by
  * a newline.
  *
+ * When it comes out of reset the arduino sends READY_BANNER, the
+ * protocol version and the capability string (see "B" below) on one
+ * line, so the host knows it can start.
+ *
  * Here are the commands:
- *  A  start the handshake.  The response is "B\n".
+ *  A  start the handshake.  The response is "B" followed by the
+ *     capability string and a newline.  The capability string lists
+ *     the letters of the optional programming commands this sketch
+ *     implements, so the host can tell what it may use.  Then "W" and
+ *     the number of command bytes the host may have in flight.
  *  I  go to idle mode.  This completes the three way handshake.  No response.
  *  E  force the PIC into programming mode.  Response is either "Y\n" or "N\n".
  *  X  good bye.  Go back to awaiting a handshake.
+ *  S  change the baud rate.  Parameter is the new rate as 8 hex digits.
+ *     See commands.h for the rest of the exchange.  We go back to
+ *     BAUD whenever we go back to awaiting a handshake.
+ *  F  switch to binary frames.  Response is "F\n".  From then on every
+ *     command comes in a frame and every reply goes out in one, until
+ *     we go back to awaiting a handshake.  See commands.h.
  *
  * All of the folowing are programming commands.  Only available after "E"
- * command.  All respond with "!\n" when they complete.
+ * command.  All respond with "!\n" when they complete.  Those that start
+ * the PIC on a write or an erase respond once it has started; the next
+ * command that needs the PIC waits for it to finish, and so does "x".
  *
  *  a  Load Configuration
  *  b  Load Data for Program Memory
@@ -66,7 +168,65 @@
  *  k  Bulk Erase Program Memory
  *  l  Bulk Erase Data Memory
  *  x  Exit programming mode.
+ *
+ * The following are optional.  The host only uses them if their letter
+ * is in the capability string.  Apart from "m", each one is a compound
+ * command, doing a whole sequence of PIC operations on a single round
+ * trip.
+ *
+ *  m  Row Erase Program Memory.  Erases the row of 32 words the
+ *     address is in.
+ *  n  Load Row.  Parameter is a 2 digit word count (1 to
+ *     PIC_NUMBER_OF_LATCHES) followed by that many 4 digit words.
+ *     For each word: Load Data for Program Memory, then Increment
+ *     Address.  Begin Programming is issued after the last word is
+ *     loaded, before its Increment Address.
+ *  o  Read Words.  Parameters are 2 digits, 00 for program memory or
+ *     01 for data memory, and a 2 digit word count (1 to READ_MAX).
+ *     For each word: Read Data, then Increment Address.  The words
+ *     come back before the "!", 4 digits each.  READ_MAX is sent as
+ *     "R" and a number in the capability string.
+ *  p  CRC Words.  Parameters are 2 digits for the memory, as for Read
+ *     Words, and a 4 digit word count.  Reads that many words the same
+ *     way and sends back the CRC-32 of them (see commands.h) as two
+ *     words, low one first, before the "!".  Lets the host verify a
+ *     range without reading it back.
+ *  q  Advance Address.  Parameter is a 4 digit count.  Increment
+ *     Address that many times.
+ *  r  Write Data Bytes.  Parameter is a 2 digit byte count (1 to
+ *     PIC_NUMBER_OF_LATCHES) followed by that many 2 digit bytes.
+ *     For each byte: Load Data for Data Memory, Begin Programming,
+ *     wait PIC_TDEW_MS for the write, then Increment Address.
+ *     Acknowledged once the bytes are in, like Load Row.
+ *
+ * In binary frames the parameters are raw bytes instead of hex digits,
+ * and words are two bytes, low byte first.  So is read data.
+ *
+ * A gang build adds "T" and the number of targets to the capability
+ * string.  Each word a read sends back, the two words of a CRC among
+ * them, is then sent once for each target, target 0 first, and
+ * READ_MAX is smaller to make room.
+ *
+ * CAPABILITIES, in commands.h, has the letters for this sketch.
+ */
+
+/*
+ * The host may send commands without waiting for each '!', as long
+ * as the commands it has not seen acknowledged fit in the serial
+ * receive buffer.  Each command is read out of the buffer before it
+ * is acknowledged, so that can never overflow.  A command longer than
+ * the buffer, such as a whole Load Row in hex, is sent only when
+ * nothing else is waiting, and read as it arrives.
  */
+#ifndef SERIAL_RX_BUFFER_SIZE
+#define  SERIAL_RX_BUFFER_SIZE  64
+#endif
+#define  RX_WINDOW  (SERIAL_RX_BUFFER_SIZE - 1)
+
+#define  PIC_NUMBER_OF_LATCHES  16
+
+unsigned int row[PIC_NUMBER_OF_LATCHES];  // Load Row words, off the wire
+byte rowLen;
 
 
 /*
@@ -79,6 +239,42 @@
 
 byte state;
 byte c;  // the current command
+unsigned long baud;
+
+/*
+ * Binary framed mode.
+ */
+#define  FRAME_TIMEOUT  50  // ms to wait for the rest of a frame
+#if PIC_TARGETS > 4
+#define  REPLY_MAX      (4 * PIC_TARGETS)  // a CRC from each target
+#else
+#define  REPLY_MAX      16
+#endif
+#define  READ_MAX       (REPLY_MAX / 2 / PIC_TARGETS)  // words in a Read Words
+
+byte framed;             // the host has asked for frames
+byte frame[FRAME_MAX];   // payload of the current frame
+byte frameLen;
+byte framePos;           // next parameter byte in the frame
+byte rxSeq;              // sequence number of the current frame
+byte expectSeq;          // sequence number we want next
+byte nakSent;            // already asked for a resend
+byte reply[REPLY_MAX];   // data to go out with the next reply
+byte replyLen;
+unsigned short txCrc;
+
+/*
+ * The last few replies, so they can be sent again if the host didn't
+ * get them.  Must cover more frames than fit in the receive window.
+ */
+#define  HISTORY  16
+
+struct {
+  byte seq;
+  byte status;
+  byte len;
+  byte data[REPLY_MAX];
+} history[HISTORY];
 
 static void
 blnk(int n)
@@ -94,21 +290,37 @@ blnk(int n)
 
 void resetPIC()
 {
+  waitForPic();
   digitalWrite(PIN_PIC_MCLR, LOW);  // reset the PIC
   delayMicroseconds(10);
   pinMode(PIN_PIC_ICSPCLK, OUTPUT);
   digitalWrite(PIN_PIC_ICSPCLK, LOW);
-  pinMode(PIN_PIC_ICSPDAT, OUTPUT);
-  digitalWrite(PIN_PIC_ICSPDAT, LOW);
+  DAT_LOW();
+  DAT_OUTPUT();
 }
 
 void releasePIC()
 {
+  waitForPic();
   pinMode(PIN_PIC_ICSPCLK, INPUT);
-  pinMode(PIN_PIC_ICSPDAT, INPUT);
+  DAT_INPUT();
   digitalWrite(PIN_PIC_MCLR, HIGH);
 }
   
+void
+sendCapabilities()
+{
+  Serial.print(CAPABILITIES);
+#if PIC_TARGETS > 1
+  Serial.print("T");
+  Serial.print(PIC_TARGETS);
+#endif
+  Serial.print("R");
+  Serial.print(READ_MAX);
+  Serial.print("W");
+  Serial.println(RX_WINDOW);
+}
+
 void setup() {
   pinMode(PIN_LED, OUTPUT);
   digitalWrite(PIN_LED, LOW);
@@ -118,8 +330,207 @@ void setup() {
   delay(10);
   releasePIC();
   
-  Serial.begin(9600);
+  Serial.begin(BAUD);
+  baud = BAUD;
   state = P_S0;
+  
+  Serial.print(READY_BANNER " ");
+  Serial.print(PROTOCOL_VERSION);
+  Serial.print(" ");
+  sendCapabilities();
+}
+
+/*
+ * Read a byte, giving up after ms milliseconds.
+ */
+int
+timedRead(unsigned int ms)
+{
+  unsigned long start;
+  
+  start = millis();
+  while (!Serial.available())
+    if (millis() - start > ms)
+      return -1;
+  return Serial.read();
+}
+
+/*
+ * Switch baud rates once everything already written has gone out.
+ * Whatever is in the receive buffer was sent at the old rate.
+ */
+void
+setSpeed(unsigned long rate)
+{
+  Serial.flush();
+  Serial.end();
+  Serial.begin(rate);
+  baud = rate;
+}
+
+/*
+ * Frame I/O.
+ */
+int
+frameByte()
+{
+  return timedRead(FRAME_TIMEOUT);
+}
+
+void
+frameOut(byte b)
+{
+  txCrc = crc16_update(txCrc, b);
+  Serial.write(b);
+}
+
+void
+sendFrame(byte seq, byte status)
+{
+  byte i;
+  
+  Serial.write(FRAME_SYNC);
+  txCrc = 0xffff;
+  frameOut(replyLen + 1);
+  frameOut(seq);
+  frameOut(status);
+  for (i = 0; i < replyLen; i++)
+    frameOut(reply[i]);
+  Serial.write(txCrc & 0xff);
+  Serial.write(txCrc >> 8);
+  replyLen = 0;
+}
+
+/*
+ * Send the saved replies from frame seq up to the current one.
+ */
+void
+replayFrom(byte seq)
+{
+  byte h;
+  
+  if ((byte)(expectSeq - seq) > HISTORY)
+    seq = expectSeq - HISTORY;
+  for (; seq != expectSeq; seq++) {
+    h = seq % HISTORY;
+    if (history[h].seq != seq)
+      continue;
+    replyLen = history[h].len;
+    memcpy(reply, history[h].data, replyLen);
+    sendFrame(seq, history[h].status);
+  }
+}
+
+void
+sendNak()
+{
+  replyLen = 0;
+  sendFrame(expectSeq, FRAME_NAK);
+  nakSent = true;
+}
+
+/*
+ * Read a frame into frame[].  Returns true if it holds the next
+ * command to execute.  A damaged frame is NAKed every time.  A good
+ * frame that is out of order is NAKed once per gap, and a resent
+ * frame we already executed is dropped.
+ */
+boolean
+readFrame()
+{
+  int b;
+  byte i;
+  byte seq;
+  unsigned short crc;
+  
+  if (Serial.read() != FRAME_SYNC)
+    return false;    // noise between frames
+    
+  crc = 0xffff;
+  b = frameByte();
+  if (b < 1 || b > FRAME_MAX) {
+    sendNak();
+    return false;
+  }
+  frameLen = b;
+  crc = crc16_update(crc, b);
+  
+  b = frameByte();
+  seq = b;
+  crc = crc16_update(crc, b);
+  for (i = 0; i < frameLen && b >= 0; i++) {
+    b = frameByte();
+    frame[i] = b;
+    crc = crc16_update(crc, b);
+  }
+  if (b < 0 || frameByte() != (crc & 0xff) || frameByte() != (crc >> 8)) {
+    sendNak();
+    return false;
+  }
+  
+  if (frame[0] == FRAME_STATUS) {
+    if (frameLen > 1)
+      replayFrom(frame[1]);
+    reply[0] = frameLen > 2 ? frame[2] : 0;   // the host's request tag
+    replyLen = 1;
+    sendFrame(expectSeq, FRAME_STATUS);
+    return false;
+  }
+  
+  if (seq != expectSeq) {
+    if ((byte)(expectSeq - seq) > 128 && !nakSent)
+      sendNak();
+    return false;
+  }
+  
+  nakSent = false;
+  rxSeq = seq;
+  expectSeq++;
+  framePos = 1;
+  return true;
+}
+
+byte
+frameParam()
+{
+  if (framePos < frameLen)
+    return frame[framePos++];
+  return 0;
+}
+
+/*
+ * Reply to the current command, in whichever mode we are in.
+ */
+void
+replyWord(unsigned int value)
+{
+  if (framed) {
+    reply[replyLen++] = value & 0xff;
+    reply[replyLen++] = value >> 8;
+    return;
+  }
+  Serial.print((value >> 12) & 0xf, HEX);
+  Serial.print((value >>  8) & 0xf, HEX);
+  Serial.print((value >>  4) & 0xf, HEX);
+  Serial.print( value        & 0xf, HEX);
+}
+
+void
+sendReply(byte status)
+{
+  byte h;
+  
+  if (framed) {
+    h = rxSeq % HISTORY;
+    history[h].seq = rxSeq;
+    history[h].status = status;
+    history[h].len = replyLen;
+    memcpy(history[h].data, reply, replyLen);
+    sendFrame(rxSeq, status);
+    return;
+  }
+  Serial.write(status);
+  Serial.println();
 }
 
 /*
@@ -133,48 +544,52 @@ void
 sendToPic(int bits, unsigned int val)
 {
   byte i;
-  byte b;
   
   for (i = 0; i < bits; i++) {
-    b = val & 0x1;
+    CLK_HIGH();
+    if (val & 0x1)
+      DAT_HIGH();
+    else
+      DAT_LOW();
     val >>= 1;
-    
-    digitalWrite(PIN_PIC_ICSPCLK, HIGH);
-    digitalWrite(PIN_PIC_ICSPDAT, b);
-    delayMicroseconds(3);                // requirement is that data is stable on the falling clock.
-    digitalWrite(PIN_PIC_ICSPCLK, LOW);
-    delayMicroseconds(3);
+    ICSP_DELAY(PIC_TCK_NS);    // requirement is that data is stable on the falling clock.
+    CLK_LOW();
+    ICSP_DELAY(PIC_TCK_NS);
   }
 }
 
 /*
- * Get some bits from the PIC.
- * Presumed to come off LSB first.
+ * Get some bits from the PICs into picWord[], one word for each
+ * target.  Presumed to come off LSB first.  The data lines are
+ * sampled together, one port read a bit, and sorted out afterwards
+ * so every clock is the same length.
  */
-unsigned int
+unsigned int picWord[PIC_TARGETS];
+
+void
 getFromPic(int bits)
 {
   byte i;
-  byte b;
-  unsigned int value, tv;
-  
-  value = 0;
+  byte t;
+  byte sample[16];
   
-  pinMode(PIN_PIC_ICSPDAT, INPUT);
+  DAT_INPUT();
   
   for (i = 0; i < bits; i++) {
-    digitalWrite(PIN_PIC_ICSPCLK, HIGH);
-    delayMicroseconds(3);
-    digitalWrite(PIN_PIC_ICSPCLK, LOW);
-    delayMicroseconds(3);
-    tv = 0;
-    if (digitalRead(PIN_PIC_ICSPDAT))
-      tv = (1 << i);
-    value |= tv;
+    CLK_HIGH();
+    ICSP_DELAY(PIC_TCK_NS);
+    CLK_LOW();
+    ICSP_DELAY(PIC_TCK_NS);
+    sample[i] = DAT_READ();
   }
-  pinMode(PIN_PIC_ICSPDAT, OUTPUT);
+  DAT_OUTPUT();
   
-  return value;
+  for (t = 0; t < PIC_TARGETS; t++) {
+    picWord[t] = 0;
+    for (i = 0; i < bits; i++)
+      if (sample[i] & DAT_BIT(t))
+        picWord[t] |= 1U << i;
+  }
 }
 
 
@@ -191,7 +606,7 @@ void enterProgramMode()
   sendToPic(1, 0);    // one more clock pulse needed
 
 // OK, it should be in programming mode.
-  Serial.println("Y");
+  sendReply('Y');
 }
 
 void copySignal()
@@ -208,6 +623,40 @@ void copySignal()
     }
 }
 
+/*
+ * Try the baud rate the host asked for.  Keep it only if the test
+ * pattern and the host's confirmation both come through.
+ */
+void changeSpeed()
+{
+  unsigned long rate;
+  unsigned long old;
+  byte i;
+  
+  rate = 0;
+  for (i = 0; i < 8; i++)
+    rate = (rate << 4) | getHexC();
+  if (rate < BAUD || rate > MAX_BAUD) {
+    Serial.println("N");
+    return;
+  }
+  Serial.println("S");
+  old = baud;
+  setSpeed(rate);
+  
+  for (i = 0; i < sizeof speed_pattern; i++)
+    if (timedRead(SPEED_TIMEOUT) != speed_pattern[i])
+      goto fail;
+  Serial.write(speed_pattern, sizeof speed_pattern);
+  if (timedRead(SPEED_TIMEOUT) != 'K')
+    goto fail;
+  Serial.println("K");
+  return;
+  
+fail:
+  setSpeed(old);
+}
+
 /*
  * This routine processes most commands.
  */
@@ -226,6 +675,15 @@ void command() {
     case 'R':
       releasePIC();
       break;
+    case 'S':
+      changeSpeed();
+      break;
+    case 'F':
+      Serial.println("F");
+      framed = true;
+      expectSeq = 0;
+      nakSent = false;
+      break;
     default:    // on communications error, go back to state 0, but don't let the PIC run.
       state = P_S0;
       break;
@@ -259,11 +717,32 @@ getHexC()
 }
       
 
+byte
+read_byte_from_serial()
+{
+  byte value;
+  
+  if (framed)
+    return frameParam();
+    
+  value = getHexC();
+  value <<= 4;
+  value |= getHexC();
+  
+  return value;
+}
+
 unsigned int
 read_word_from_serial()
 {
   unsigned int value;
   
+  if (framed) {
+    value = frameParam();
+    value |= frameParam() << 8;
+    return value;
+  }
+  
   value = getHexC();
   value <<= 4;
   value |= getHexC();
@@ -275,37 +754,199 @@ read_word_from_serial()
   return value;
 }
  
+/*
+ * Begin Programming and the bulk erases leave the PIC busy for a few
+ * milliseconds.  Rather than wait then, we note when it will be done
+ * and go back to reading commands; whatever next talks to the PIC
+ * waits first.  A Load Row's last Increment Address is held over to
+ * then too.
+ */
+byte picBusy;
+byte incrementPending;
+unsigned long picDoneAt;  // micros()
+
+void busyFor(unsigned int ms) {
+  picBusy = true;
+  picDoneAt = micros() + ms * 1000UL;
+}
+
+void waitForPic() {
+  if (!picBusy)
+    return;
+  while ((long)(micros() - picDoneAt) < 0)
+    ;
+  picBusy = false;
+  if (incrementPending) {
+    incrementPending = false;
+    sendCmd(0x6);
+  }
+}
+
 void sendCmd(byte cmd) {
-  pinMode(PIN_PIC_ICSPDAT, OUTPUT);
+  waitForPic();
+  DAT_OUTPUT();
   sendToPic(6, cmd);
+  ICSP_DELAY(PIC_TDLY_NS);   // before any data
 }
 
-void sendWord(byte cmd) {
-  unsigned int value;
+/*
+ * Send a 14 bit data word, framed by a start and a stop bit.
+ */
+void sendData(unsigned int value) {
   byte b;
-  sendCmd(cmd);
   
-  value = read_word_from_serial();
   b = (value & 0x7f) << 1;
   sendToPic(8, b);
   b = (value >> 7) & 0x7f;
   sendToPic(8, b);
 }
 
-void readWord(byte cmd) {
-  unsigned int value;
+void sendWord(byte cmd) {
+  sendCmd(cmd);
+  sendData(read_word_from_serial());
+}
+
+/*
+ * Read the parameters of a Load Row into row[].
+ * Returns false if the word count is bad.
+ */
+boolean readRow() {
+  byte i;
+  
+  rowLen = read_byte_from_serial();
+  if (rowLen < 1 || rowLen > PIC_NUMBER_OF_LATCHES)
+    return false;
+  for (i = 0; i < rowLen; i++)
+    row[i] = read_word_from_serial();
+  return true;
+}
+
+/*
+ * Load row[] into the latches and start programming it.
+ */
+void writeRow() {
+  byte i;
+  
+  for (i = 0; i < rowLen; i++) {
+    sendCmd(0x2);
+    sendData(row[i]);
+    if (i == rowLen - 1) {
+      sendCmd(0x8);
+      busyFor(5);
+      incrementPending = true;
+    } else
+      sendCmd(0x6);
+  }
+}
+
+/*
+ * The bytes of a Write Data Bytes go in row[] too.
+ */
+boolean readDataRow() {
+  byte i;
+  
+  rowLen = read_byte_from_serial();
+  if (rowLen < 1 || rowLen > PIC_NUMBER_OF_LATCHES)
+    return false;
+  for (i = 0; i < rowLen; i++)
+    row[i] = read_byte_from_serial();
+  return true;
+}
+
+/*
+ * Write row[] into data memory a byte at a time.  Each write has to
+ * finish before the next byte is loaded.
+ */
+void writeDataRow() {
+  byte i;
+  
+  for (i = 0; i < rowLen; i++) {
+    sendCmd(0x3);
+    sendData(row[i]);
+    sendCmd(0x8);
+    busyFor(PIC_TDEW_MS);
+    incrementPending = true;
+  }
+}
+
+/*
+ * Read a word from each target into picWord[].
+ */
+void readFromPic(byte cmd) {
+  byte t;
   
   sendCmd(cmd);
-  value = 0;
-  // get the word from the PIC
-  value = getFromPic(16);
-  value >>= 1;
-  value &= 0x3fff;
+  getFromPic(16);
+  for (t = 0; t < PIC_TARGETS; t++)
+    picWord[t] = (picWord[t] >> 1) & 0x3fff;
+}
+
+void readWord(byte cmd) {
+  byte t;
   
-  Serial.print((value >> 12) & 0xf, HEX);
-  Serial.print((value >>  8) & 0xf, HEX);
-  Serial.print((value >>  4) & 0xf, HEX);
-  Serial.print( value        & 0xf, HEX);
+  readFromPic(cmd);
+  for (t = 0; t < PIC_TARGETS; t++)
+    replyWord(picWord[t]);
+}
+
+/*
+ * Read a run of words, from program memory or data memory.
+ * Returns false if the parameters are bad.
+ */
+boolean readWords() {
+  byte memory;
+  byte n;
+  
+  memory = read_byte_from_serial();
+  n = read_byte_from_serial();
+  if (memory > 1 || n < 1 || n > READ_MAX)
+    return false;
+  for (; n > 0; n--) {
+    readWord(memory ? 0x5 : 0x4);
+    sendCmd(0x6);
+  }
+  return true;
+}
+
+/*
+ * CRC a run of words, from program memory or data memory.
+ * Returns false if the parameters are bad.
+ */
+boolean crcWords() {
+  byte memory;
+  byte t;
+  unsigned int n;
+  unsigned long crc[PIC_TARGETS];
+  
+  memory = read_byte_from_serial();
+  n = read_word_from_serial();
+  if (memory > 1 || n < 1)
+    return false;
+  for (t = 0; t < PIC_TARGETS; t++)
+    crc[t] = 0xffffffff;
+  for (; n > 0; n--) {
+    readFromPic(memory ? 0x5 : 0x4);
+    sendCmd(0x6);
+    for (t = 0; t < PIC_TARGETS; t++) {
+      crc[t] = crc32_update(crc[t], picWord[t] & 0xff);
+      crc[t] = crc32_update(crc[t], picWord[t] >> 8);
+    }
+  }
+  for (t = 0; t < PIC_TARGETS; t++)
+    replyWord(~crc[t] & 0xffff);
+  for (t = 0; t < PIC_TARGETS; t++)
+    replyWord((~crc[t] >> 16) & 0xffff);
+  return true;
+}
+
+/*
+ * Move the address on by the count the host sent.
+ */
+void advanceAddress() {
+  unsigned int n;
+  
+  for (n = read_word_from_serial(); n > 0; n--)
+    sendCmd(0x6);
 }
 
 void
@@ -349,26 +990,80 @@ programming_command()
     // Begin Programming
     case 'h':
       sendCmd(0x8);
-      // need to wait some here
-      delay(5);
+      busyFor(5);
       break;
     
     // Bulk Erase Program Memory
     case 'k':
       sendCmd(0x9);
-      // need to wait some here
-      delay(5);
+      busyFor(5);
       break;
     
     // Bulk Erase Data Memory
     case 'l':
       sendCmd(0xb);
-      // need to wait some here
-      delay(5);
+      busyFor(5);
+      break;
+      
+    // Row Erase Program Memory
+    case 'm':
+      sendCmd(0x11);
+      busyFor(5);
+      break;
+      
+    // Load Row.  Acknowledged as soon as we have the words, so the
+    // host can send the next row while this one is written.  A row
+    // too long for the receive buffer in hex is acknowledged after,
+    // so we are reading again when the next long one comes.
+    case 'n':
+      if (!readRow()) {
+        state = P_S0;
+        return;
+      }
+      if (!framed && 3 + 4 * rowLen > RX_WINDOW) {
+        writeRow();
+        sendReply('!');
+        return;
+      }
+      sendReply('!');
+      writeRow();
+      return;
+      
+    // Read Words
+    case 'o':
+      if (!readWords()) {
+        state = P_S0;
+        return;
+      }
+      break;
+      
+    // CRC Words
+    case 'p':
+      if (!crcWords()) {
+        state = P_S0;
+        return;
+      }
+      break;
+      
+    // Advance Address
+    case 'q':
+      advanceAddress();
       break;
       
+    // Write Data Bytes.  Acknowledged before the writes, as for
+    // Load Row.
+    case 'r':
+      if (!readDataRow()) {
+        state = P_S0;
+        return;
+      }
+      sendReply('!');
+      writeDataRow();
+      return;
+      
     // Exit programming mode.
     case 'x':
+      waitForPic();
       state = P_CON;
       break;
       
@@ -377,7 +1072,7 @@ programming_command()
       state = P_S0;
       return;
   }
-  Serial.println("!");
+  sendReply('!');
 }
 
 #ifdef TESTPIC
@@ -413,7 +1108,8 @@ testpic()
   //sendCmd(0x16); // reset address
 /*xxx*/flag("-- B");
   sendCmd(0x4);  // read data from program memory
-  value = getFromPic(16);
+  getFromPic(16);
+  value = picWord[0];
   Serial.println("Value returned is");
   Serial.print(value, HEX);
   Serial.println(" Done");
@@ -438,16 +1134,23 @@ void loop() {
     }
     return;
   }
-  c = Serial.read();
-
-  if (c == '\n' || c == '\r' || c == ' ')
-    return;
+  if (framed) {
+    if (!readFrame())
+      return;
+    c = frame[0];
+  } else {
+    c = Serial.read();
+    if (c == '\n' || c == '\r' || c == ' ')
+      return;
+  }
+  
   switch (state) {
     case P_S0:
       if (c != 'A')
         break;
 /*xxx*/digitalWrite(PIN_LED, HIGH);
-    Serial.println("B");
+    Serial.print("B");
+    sendCapabilities();
     state = P_C1;
     break;
   case P_C1:
@@ -466,4 +1169,10 @@ void loop() {
     programming_command();
     break;
   }
-}
+  
+  if (state == P_S0) {
+    framed = false;
+    if (baud != BAUD)
+      setSpeed(BAUD);
+  }
+}
@@ -9,6 +9,16 @@
  *  h  Begin Programming
  *  k  Bulk Erase Program Memory
  *  l  Bulk Erase Data Memory
+ *  m  Row Erase Program Memory
+ *
+ * Compound commands, done by the Arduino as a sequence of the above.
+ * These have no entry in PICcommands[].
+ *
+ *  n  Load Row
+ *  o  Read Words
+ *  p  CRC Words
+ *  q  Advance Address
+ *  r  Write Data Bytes
  */
 
 #define	LoadConfiguration		0
@@ -21,6 +31,104 @@
 #define	BeginProgramming		7
 #define	BulkEraseProgramMemory		10
 #define	BulkEraseDataMemory		11
+#define	RowEraseProgramMemory		12
+
+#define	LoadRow				13
+#define	ReadWords			14
+#define	CRCWords			15
+#define	AdvanceAddress			16
+#define	WriteDataBytes			17
+
+/*
+ * The start of the capability string: the optional commands this
+ * sketch implements, and "F1" and "S1" for binary frames and baud
+ * rate changes.  The sketch adds "R" and "W" with its numbers.
+ */
+#define	CAPABILITIES	"nF1S1opmqr"
+
+/*
+ * Binary framed protocol.
+ *
+ * A frame is FRAME_SYNC, the payload length, a sequence number, the
+ * payload, and a CRC-16 (CCITT, initial value 0xffff) over the length,
+ * sequence number and payload, low byte first.  Words in payloads are
+ * two bytes, low byte first.
+ *
+ * Host frames carry a command letter and its binary parameters.  Each
+ * one is answered by a frame with the same sequence number whose first
+ * payload byte is the reply ('!', 'Y', ...) followed by any data.  A
+ * frame that arrives damaged or out of order is answered by FRAME_NAK
+ * with the sequence number the arduino wants next; the host resends
+ * from there.  FRAME_STATUS, followed by a sequence number and a tag,
+ * has the arduino send its replies from that frame on again, then
+ * answer with FRAME_STATUS and the tag, in a frame carrying the
+ * sequence number it wants next.
+ */
+#define	FRAME_SYNC	0xa5
+#define	FRAME_MAX	40		/* largest payload */
+#define	FRAME_NAK	'?'
+#define	FRAME_STATUS	'#'
+
+static unsigned short
+crc16_update(unsigned short crc, unsigned char b)
+{
+	int i;
+
+	crc ^= b << 8;
+	for (i = 0; i < 8; i++) {
+		if (crc & 0x8000)
+			crc = (crc << 1) ^ 0x1021;
+		else
+			crc <<= 1;
+	}
+	return crc;
+}
+
+/*
+ * CRC-32 (the zip one: reflected, polynomial 0xedb88320), for CRC
+ * Words.  Start with 0xffffffff and invert the result.  Words go in
+ * low byte first.
+ */
+static unsigned long
+crc32_update(unsigned long crc, unsigned char b)
+{
+	int i;
+
+	crc ^= b;
+	for (i = 0; i < 8; i++) {
+		if (crc & 1)
+			crc = (crc >> 1) ^ 0xedb88320UL;
+		else
+			crc >>= 1;
+	}
+	return crc;
+}
+
+/*
+ * The arduino sends a line with READY_BANNER, the protocol version and
+ * its capability string when it comes out of reset.  An older sketch
+ * sends nothing, so the host gives up waiting after READY_TIMEOUT
+ * milliseconds, which was long enough for any reset.
+ */
+#define	READY_BANNER		"PICLoader"
+#define	PROTOCOL_VERSION	1
+#define	READY_TIMEOUT		3000
+
+/*
+ * Baud rate change.  The host sends "S" and the new rate as 8 hex
+ * digits.  The arduino answers "S\n" (or "N\n" if it can't) at the old
+ * rate and switches.  The host switches too and sends speed_pattern,
+ * which the arduino echoes.  The host then sends 'K' and the arduino
+ * answers "K\n".  If any of that fails to arrive within SPEED_TIMEOUT
+ * milliseconds, both sides go back to the old rate.
+ */
+#define	BAUD		9600		/* rate after reset and for the handshake */
+#define	SPEED_TIMEOUT	500
+#define	MAX_BAUD	2000000
+
+static unsigned char speed_pattern[] = {
+	0x55, 0xaa, 0x00, 0xff, 0x0f, 0xf0, 0x33, 0xcc,
+};
 
 #ifdef DEFINE_COMMANDS
 
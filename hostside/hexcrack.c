@@ -1,253 +1,608 @@
 /*
  * Program to read and interpret the hex output of cc5x
  *
- * Based on http://www.lucidtechnologies.info/inhx32.htm
+ * The whole file is read into an image first (see hexfile.c), so its
+ * records can come in any order.  The image is then written out in
+ * address order for the loader: P for a word, S to skip words, C then
+ * A for config space, and D with its address for data EEPROM.
+ *
+ * With -b it writes the binary image format instead (see hexfile.h).
+ *
+ * Given files or directories of them, it does them all at once on a
+ * pool of threads, writing each file.hex out as file.txt, or file.img
+ * with -b.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hexfile.h"
 
 char *myname;
 int verbose;
+int binary;		/* write binary images */
+
+/*
+ * With -v, list each record as it's read.
+ */
+void
+list_record(struct hex_parser *p, int type, unsigned address,
+	unsigned char *bytes, int count)
+{
+	int i;
+
+	printf("%2d %4x %d ", 11 + 2 * count, address, type);
+	for (i = 0; i < count; i++)
+		printf(" %02x", bytes[i]);
+	printf("\n");
+}
+
+/*
+ * Write a record: its letter and four hex digits.  There's one per
+ * word, so this is quicker than printf.
+ */
+void
+put_record(FILE *out, char c, unsigned value)
+{
+	static const char digits[] = "0123456789abcdef";
+	char line[6];
+
+	line[0] = c;
+	line[1] = digits[value >> 12 & 0xf];
+	line[2] = digits[value >> 8 & 0xf];
+	line[3] = digits[value >> 4 & 0xf];
+	line[4] = digits[value & 0xf];
+	line[5] = '\n';
+	fwrite(line, 1, sizeof line, out);
+}
 
-char buffer[128];
+/*
+ * Write out one space's words.
+ */
+void
+put_space(FILE *out, struct hex_space *s, int space)
+{
+	struct hex_segment *seg;
+	unsigned long address;
+	int i, j;
+
+	address = 0;
+	for (i = 0; i < s->count; i++) {
+		seg = &s->segments[i];
+		if (space == HEX_CONFIG && i == 0) {
+			put_record(out, 'C', 0);
+			if (seg->address != 0)
+				put_record(out, 'A', seg->address);
+		} else if (space == HEX_EEPROM && i == 0)
+			put_record(out, 'D', seg->address);
+		else if (seg->address != address)
+			put_record(out, 'S', seg->address - address);
+		for (j = 0; j < seg->count; j++)
+			put_record(out, 'P', seg->words[j]);
+		address = seg->address + seg->count;
+	}
+}
 
-int lineno;
-int sum;
-int lastline;
-int current_address;
-// 0 = normal, 1 = entering config, not yet decided what type 2 = fixed.
-int config_space;
+/*
+ * Write out the whole image, as text or binary.
+ */
+void
+put_image(FILE *out, struct hex_image *image)
+{
+	if (binary) {
+		hex_image_save(image, out, NULL);
+		return;
+	}
+	put_space(out, &image->space[HEX_PROGRAM], HEX_PROGRAM);
+	put_space(out, &image->space[HEX_CONFIG], HEX_CONFIG);
+	put_space(out, &image->space[HEX_EEPROM], HEX_EEPROM);
+}
 
+/*
+ * The parser hexcrack used to have, kept for -B to compare against:
+ * one line at a time through fgets, and a call per hex digit.  It only
+ * checks the records and doesn't keep them, so it gets off lightly.
+ * Returns how many data bytes it found, or -1 on a bad line.
+ */
 int
-hexdigit(char c)
+old_hexdigit(char c)
 {
 	if (c >= '0' && c <= '9')
 		return c - '0';
 	if (c >= 'a' && c <= 'f')
-		return c - 'a' + 10;;
+		return c - 'a' + 10;
 	if (c >= 'A' && c <= 'F')
-		return c - 'A' + 10;;
-
-	fprintf(stderr, "%s: line %d contains invalid hex digit %c\n",
-		myname, lineno, c);
-	exit(1);
+		return c - 'A' + 10;
+	return -1;
 }
 
-int
-hexbyte(char *p)
+long
+old_parse(char *data, long size)
 {
-	int t;
+	char buffer[600];
+	unsigned char bytes[256];
+	FILE *input;
+	long total;
+	int len, count, sum, d, i;
 
-	t =  hexdigit(p[0]) * 16 + hexdigit(p[1]);
-	sum += t;
-	return t;
+	input = fmemopen(data, size, "r");
+	if (input == NULL)
+		return -1;
+	total = 0;
+	while (fgets(buffer, sizeof buffer, input) == buffer) {
+		len = strlen(buffer);
+		while (len > 0 &&
+		    (buffer[len - 1] == '\n' || buffer[len - 1] == '\r'))
+			len--;
+		if (len == 0)
+			continue;
+		if (buffer[0] != ':' || len < 11 || (len & 1) == 0)
+			goto bad;
+		sum = 0;
+		count = (len - 1) / 2;
+		for (i = 0; i < count; i++) {
+			d = old_hexdigit(buffer[1 + 2 * i]) << 4 |
+				old_hexdigit(buffer[2 + 2 * i]);
+			if (d < 0)
+				goto bad;
+			bytes[i] = d;
+			sum += d;
+		}
+		if (bytes[0] != count - 5 || (sum & 0xff) != 0)
+			goto bad;
+		total += bytes[0];
+	}
+	fclose(input);
+	return total;
+bad:
+	fclose(input);
+	return -1;
 }
 
+/*
+ * With -B, time parsing the input with the old parser and then each
+ * hex decoder this machine has.  Nothing is written out.
+ */
 void
-process()
+benchmark()
 {
-	int i;
-	int type;
-	int count;
-	int len;
-	int nbytes;
-	int address;
-	int extended_address;
-	int checksum;
-	unsigned char bytes[128];
-	char *p;
-
-	sum = 0;
-
-	if (lastline) {
-		fprintf(stderr, "%s lineno %d occurs after last line "
-				"marker.\n",
-			myname,
-			lineno);
-		exit(1);
+	static char *names[] = { "scalar", "sse2", "avx2" };
+	struct hex_image image;
+	struct hex_parser parser;
+	struct timespec t0, t1;
+	char *data;
+	long size, alloc, n;
+	double secs;
+	int passes;
+	int d;
+
+	size = 0;
+	alloc = 0;
+	data = NULL;
+	for (;;) {
+		if (size + HEX_READ_SIZE > alloc) {
+			alloc = 2 * alloc + HEX_READ_SIZE;
+			data = realloc(data, alloc);
+			if (data == NULL) {
+				fprintf(stderr, "%s: out of memory\n", myname);
+				exit(1);
+			}
+		}
+		n = read(0, data + size, HEX_READ_SIZE);
+		if (n <= 0)
+			break;
+		size += n;
 	}
 
-	if (buffer[0] != ':') {
-		fprintf(stderr, "%s: line %d doesn't begin with a ':'\n",
-			myname, lineno);
-		exit(1);
+	for (d = -1; d <= HEX_DECODE_AVX2; d++) {
+		if (d >= 0 && hex_decoder(d) < 0)
+			continue;
+		passes = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		do {
+			if (d < 0) {
+				if (old_parse(data, size) < 0) {
+					fprintf(stderr, "%s: fgets parser "
+						"can't read it\n", myname);
+					exit(1);
+				}
+				goto timed;
+			}
+			hex_image_init(&image);
+			hex_parser_init(&parser, &image);
+			if (hex_parse(&parser, data, size) < 0 ||
+			    hex_parse_end(&parser) < 0) {
+				fprintf(stderr, "%s: %s\n", myname,
+					parser.error);
+				exit(1);
+			}
+			hex_image_free(&image);
+timed:
+			passes++;
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			secs = (t1.tv_sec - t0.tv_sec) +
+				(t1.tv_nsec - t0.tv_nsec) / 1e9;
+		} while (secs < 1);
+		printf("%-6s %8.1f MB/s\n", d < 0 ? "fgets" : names[d],
+			(double)size * passes / secs / 1e6);
 	}
+	free(data);
+}
 
-	len = strlen(buffer);
-	while (buffer[len-1] == '\n' || buffer[len-1]== '\r')
-		len--;
+/*
+ * Batch mode.
+ *
+ * Each input file is a job.  Threads take the next job until there
+ * are none left; a file big enough to be worth it is parsed on all
+ * the threads instead.  What each job has to say is kept until the
+ * end and printed in the order the files were given.
+ */
+struct job {
+	char *input;
+	char *output;
+	int failed;
+	char message[200];
+};
+
+struct job *jobs;
+int njobs;
+int next_job;
+int threads;
+int merge;
+char *outdir;
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	if (len < 11) {
-		fprintf(stderr, "%s: line %d too short (%d)\n", 
-			myname, lineno, len);
+/*
+ * Add a job for a file, with file.hex written out as file.txt or
+ * file.img, in outdir if there is one.
+ */
+void
+add_job(char *input)
+{
+	char *base;
+	char *dot;
+	int len;
+
+	jobs = realloc(jobs, (njobs + 1) * sizeof *jobs);
+	if (jobs == NULL) {
+		fprintf(stderr, "%s: out of memory\n", myname);
 		exit(1);
 	}
-
-	nbytes = (len - 11) / 2;
-
-	count = hexbyte(buffer + 1);
-
-	if (len != 11 + 2 * count) {
-		fprintf(stderr, "%s: line %d wrong length.  (%d %d)\n",
-			myname,
-			lineno,
-			len,
-			11 + 2 * count);
+	base = outdir == NULL ? input : strrchr(input, '/');
+	base = base == NULL ? input : base + (outdir != NULL);
+	len = (outdir == NULL ? 0 : strlen(outdir) + 1) + strlen(base) + 5;
+	memset(&jobs[njobs], 0, sizeof *jobs);
+	jobs[njobs].input = input;
+	jobs[njobs].output = malloc(len);
+	if (jobs[njobs].output == NULL) {
+		fprintf(stderr, "%s: out of memory\n", myname);
 		exit(1);
 	}
+	if (outdir == NULL)
+		strcpy(jobs[njobs].output, base);
+	else
+		sprintf(jobs[njobs].output, "%s/%s", outdir, base);
+	dot = strrchr(jobs[njobs].output, '.');
+	if (dot != NULL && strchr(dot, '/') == NULL &&
+	    strcasecmp(dot, ".hex") == 0)
+		*dot = 0;
+	strcat(jobs[njobs].output, binary ? ".img" : ".txt");
+	njobs++;
+}
 
-	address = 0x100 * hexbyte(buffer + 3) + hexbyte(buffer + 5);
-
-	type = hexbyte(buffer+7);
-
-	p = buffer + 9;
-	for (i = 0; i < nbytes; i++)
-		bytes[i] = hexbyte(p + i * 2);
+int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
 
-	checksum = sum;
-	sum = 0;
+/*
+ * Add a job for each .hex file in a directory, in name order.
+ */
+void
+add_directory(char *dir)
+{
+	DIR *d;
+	struct dirent *e;
+	char **names;
+	int n;
+	int len;
+	int i;
 
-	if ((0xff & (-1 * checksum)) != hexbyte(buffer + len - 2)) {
-		fprintf(stderr, "%s: line %d checksum error.  %02x  %02x\n",
-			myname,
-			lineno,
-			0xff & (-1 * checksum),
-			sum);
+	d = opendir(dir);
+	if (d == NULL) {
+		fprintf(stderr, "%s: can't read %s: %s\n",
+			myname, dir, strerror(errno));
 		exit(1);
 	}
-
-
-	switch(type) {
-	    case 0:
-	    	if (config_space) {
-		    if (address < current_address) {
-			fprintf(stderr, "%s: line no %d config load address "
-					"skips backwards from %x to %x\n",
-				myname,
-				lineno,
-				current_address,
-				address);
+	names = NULL;
+	n = 0;
+	while ((e = readdir(d)) != NULL) {
+		len = strlen(e->d_name);
+		if (len <= 4 || strcasecmp(e->d_name + len - 4, ".hex") != 0)
+			continue;
+		names = realloc(names, (n + 1) * sizeof *names);
+		if (names == NULL ||
+		    (names[n] = malloc(strlen(dir) + len + 2)) == NULL) {
+			fprintf(stderr, "%s: out of memory\n", myname);
 			exit(1);
-		    } else if (address != current_address) {
-			printf("A%04x\n", address/2);
-			current_address = address;
-		    }
-		} else {
-		    if (address != current_address) {
-#ifdef notworking
-		    	printf("S%04x\n", (address - current_address)/2);
-#else
-			for (i = 0; i < (address - current_address)/2; i++)
-				printf("P0000\n");
-#endif
-			current_address = address;
-		    }
-		}
-
-		for (i = 0; i < nbytes; i+= 2) {
-			printf("P%02x%02x\n",
-				bytes[i+1],
-				bytes[i]);
-			current_address += 2;
 		}
+		sprintf(names[n++], "%s/%s", dir, e->d_name);
+	}
+	closedir(d);
+	qsort(names, n, sizeof *names, compare_names);
+	for (i = 0; i < n; i++)
+		add_job(names[i]);
+	free(names);
+}
 
-	    	break;
-
-	    case 1:
-	    	if (address != 0 || nbytes != 0) {
-			fprintf(stderr, "%s: line no %d "
-					"unknown type 1 record\n", 
-				myname,
-				lineno);
-			fprintf(stderr, "\taddress = %x, nbytes = %d\n",
-				address,
-				nbytes);
-			exit(1);
+/*
+ * Read a file into memory: mapped if it's a plain file, otherwise
+ * read.  Returns NULL with a message in the job if it can't.
+ */
+char *
+load_file(struct job *j, long *size, int *mapped)
+{
+	struct stat st;
+	char *data;
+	long alloc;
+	ssize_t n;
+	int fd;
+
+	fd = open(j->input, O_RDONLY);
+	if (fd < 0)
+		goto fail;
+	*mapped = 0;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			close(fd);
+			*mapped = 1;
+			*size = st.st_size;
+			return data;
 		}
-		lastline++;
-	    	break;
-
-	    case 4:
-	    	if (address != 0 || nbytes != 2) {
-			fprintf(stderr, "%s: line no %d "
-					"unknown type 4 record\n", 
-				myname,
-				lineno);
-			fprintf(stderr, "\taddress = %x, nbytes = %d\n",
-				address,
-				nbytes);
-			exit(1);
+	}
+	data = NULL;
+	alloc = 0;
+	*size = 0;
+	do {
+		if (*size + HEX_READ_SIZE > alloc) {
+			alloc = 2 * alloc + HEX_READ_SIZE;
+			data = realloc(data, alloc);
+			if (data == NULL) {
+				close(fd);
+				sprintf(j->message, "out of memory");
+				return NULL;
+			}
 		}
+		n = read(fd, data + *size, HEX_READ_SIZE);
+		if (n > 0)
+			*size += n;
+	} while (n > 0);
+	if (n == 0) {
+		close(fd);
+		return data;
+	}
+	free(data);
+	close(fd);
+    fail:
+	sprintf(j->message, "%s", strerror(errno));
+	return NULL;
+}
 
-		extended_address = (bytes[0] << 8) | bytes[1];
-		if (config_space) {
-			// already in config space
-			if (extended_address == 0) {
-			    fprintf(stderr, "%s: line no %d "
-					"exit from config space NYI\n",
-				myname, lineno);
-			    exit(1);
-			} else if (current_address != 0) {
-			    fprintf(stderr, "%s: line no %d "
-					"reset within config space NYI\n",
-				myname, lineno);
-			    exit(1);
-			}
+void
+do_job(struct job *j)
+{
+	struct hex_image image;
+	char *data;
+	long size;
+	int mapped;
+	FILE *out;
+	int n;
+
+	data = load_file(j, &size, &mapped);
+	if (data == NULL) {
+		j->failed = 1;
+		return;
+	}
+	hex_image_init(&image);
+	image.merge = merge;
+	/* With other files going at once, they already use the threads */
+	n = size >= 2 * HEX_SPLIT_MIN && njobs == 1 ? threads : 1;
+	if (hex_parse_split(&image, data, size, n, j->message) < 0)
+		j->failed = 1;
+	if (mapped)
+		munmap(data, size);
+	else
+		free(data);
+
+	if (!j->failed) {
+		out = fopen(j->output, "w");
+		if (out == NULL) {
+			snprintf(j->message, sizeof j->message,
+				"can't write %s: %s", j->output,
+				strerror(errno));
+			j->failed = 1;
 		} else {
-			// not currently in config space
-			if (extended_address == 1) {
-				// entering config space
-				config_space = 1;
-				current_address = 0;
-				printf("C0000\n");
-			} else if (current_address != 0) {
-				fprintf(stderr, "%s: line no %d "
-						"general type 4 records NYI\n", 
-				    myname,
-				    lineno);
-				fprintf(stderr, "\tExtended address = %04x\n",
-					extended_address);
-				exit(1);
+			put_image(out, &image);
+			if (fclose(out) != 0) {
+				snprintf(j->message, sizeof j->message,
+					"can't write %s: %s", j->output,
+					strerror(errno));
+				j->failed = 1;
 			}
 		}
-	    	break;
+	}
+	hex_image_free(&image);
+}
 
-	    default:
-		fprintf(stderr, "%s: line %d invalid type code %d\n",
-			myname, lineno, type);
-		exit(1);
+void *
+job_thread(void *arg)
+{
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		i = next_job++;
+		pthread_mutex_unlock(&job_lock);
+		if (i >= njobs)
+			return NULL;
+		do_job(&jobs[i]);
 	}
+}
 
-	if (verbose) {
-		printf("%2d %4x %d ", len, address, type);
-		for(i = 0; i < nbytes; i++)
-			printf(" %02x", bytes[i]);
-		printf("\n");
+/*
+ * Do all the jobs.  Returns how many failed.
+ */
+int
+batch()
+{
+	pthread_t *tid;
+	int started;
+	int failed;
+	int n;
+	int i;
+
+	n = threads < njobs ? threads : njobs;
+	tid = malloc(n * sizeof *tid);
+	if (tid == NULL) {
+		fprintf(stderr, "%s: out of memory\n", myname);
+		exit(1);
 	}
+	for (started = 0; started < n - 1; started++)
+		if (pthread_create(&tid[started], NULL, job_thread, NULL) != 0)
+			break;
+	job_thread(NULL);
+	while (started > 0)
+		pthread_join(tid[--started], NULL);
+	free(tid);
+
+	failed = 0;
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].failed) {
+			fprintf(stderr, "%s: %s: %s\n",
+				myname, jobs[i].input, jobs[i].message);
+			failed++;
+		}
+	}
+	if (failed)
+		fprintf(stderr, "%s: %d of %d files failed\n",
+			myname, failed, njobs);
+	return failed;
 }
 
+void
+usage()
+{
+	fprintf(stderr, "usage: %s [-v | -b] [-o | -s] [-B] < file.hex\n",
+		myname);
+	fprintf(stderr, "       %s [-b] [-o | -s] [-j threads] [-O dir] "
+			"file.hex|dir ...\n",
+		myname);
+	fprintf(stderr, "\t-v (list the records)\n");
+	fprintf(stderr, "\t-b (write a binary image)\n");
+	fprintf(stderr, "\t-o (later data for an address replaces "
+			"earlier)\n");
+	fprintf(stderr, "\t-s (any address given twice is an error)\n");
+	fprintf(stderr, "\t-B (time the parser with each decoder)\n");
+	fprintf(stderr, "\t-j threads (how many at once, default one per "
+			"CPU)\n");
+	fprintf(stderr, "\t-O dir (write the .txt files there)\n");
+	exit(1);
+}
 
 int
 main(int argc, char **argv)
 {
-	FILE *input;
+	struct hex_image image;
+	struct hex_parser parser;
+	struct stat st;
+	int bench;
+	int c;
 
 	myname = *argv;
 	verbose = 0;
+	bench = 0;
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	hex_image_init(&image);
+
+	while ((c = getopt(argc, argv, "vbosBj:O:")) != -1) {
+		switch (c) {
+		    case 'v':
+			verbose++;
+			break;
+		    case 'b':
+			binary = 1;
+			break;
+		    case 'o':
+			image.merge = HEX_MERGE_LAST;
+			break;
+		    case 's':
+			image.merge = HEX_MERGE_NONE;
+			break;
+		    case 'B':
+			bench = 1;
+			break;
+		    case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				usage();
+			break;
+		    case 'O':
+			outdir = optarg;
+			break;
+		    default:
+			usage();
+		}
+	}
+	if (verbose && binary)
+		usage();
+	if (threads < 1)
+		threads = 1;
+	if (threads > HEX_THREADS_MAX)
+		threads = HEX_THREADS_MAX;
+
+	if (optind != argc) {
+		if (verbose || bench)
+			usage();
+		merge = image.merge;
+		for (; optind < argc; optind++) {
+			if (stat(argv[optind], &st) == 0 &&
+			    S_ISDIR(st.st_mode))
+				add_directory(argv[optind]);
+			else
+				add_job(argv[optind]);
+		}
+		return batch() ? 1 : 0;
+	}
+	if (outdir != NULL)
+		usage();
 
-	lineno = 1;
-	lastline = 0;
-	input = stdin;
-	current_address = 0;
-	config_space = 0;
-	while (fgets(buffer, sizeof buffer, input) == buffer) {
-		process();
-		lineno++;
+	if (bench) {
+		benchmark();
+		return 0;
 	}
-	if (!lastline) {
-		fprintf(stderr, "%s: no type 1 record found\n", myname);
+
+	hex_parser_init(&parser, &image);
+	if (verbose)
+		parser.record = list_record;
+	if (hex_read(&parser, 0) < 0) {
+		fprintf(stderr, "%s: %s\n", myname, parser.error);
+		exit(1);
+	}
+
+	put_image(stdout, &image);
+	if (fflush(stdout) != 0 || ferror(stdout)) {
+		fprintf(stderr, "%s: write error\n", myname);
 		exit(1);
 	}
 	return 0;
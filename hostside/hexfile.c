@@ -0,0 +1,1301 @@
+/*
+ * Read Intel HEX into a sparse image of a PIC's memories.
+ *
+ * Based on http://www.lucidtechnologies.info/inhx32.htm
+ * See hexfile.h for the address map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hexfile.h"
+
+void
+hex_image_init(struct hex_image *im)
+{
+	memset(im, 0, sizeof *im);
+	im->space[HEX_PROGRAM].blank = 0x3fff;
+	im->space[HEX_CONFIG].blank = 0x3fff;
+	im->space[HEX_EEPROM].blank = 0x00ff;
+	im->merge = HEX_MERGE_SAME;
+}
+
+static void
+segment_free(struct hex_segment *seg)
+{
+	free(seg->words);
+	free(seg->present);
+	free(seg->lines);
+}
+
+void
+hex_image_free(struct hex_image *im)
+{
+	int s;
+	int i;
+
+	for (s = 0; s < HEX_SPACES; s++) {
+		for (i = 0; i < im->space[s].count; i++)
+			segment_free(&im->space[s].segments[i]);
+		free(im->space[s].segments);
+	}
+	hex_image_init(im);
+}
+
+/*
+ * Make room for at least n words in a segment.
+ */
+static int
+segment_reserve(struct hex_segment *seg, int n)
+{
+	int size;
+	void *w, *p, *l;
+
+	if (n <= seg->size)
+		return 0;
+	size = seg->size ? seg->size : 64;
+	while (size < n)
+		size *= 2;
+	w = realloc(seg->words, size * sizeof *seg->words);
+	if (w != NULL)
+		seg->words = w;
+	p = realloc(seg->present, size * sizeof *seg->present);
+	if (p != NULL)
+		seg->present = p;
+	l = realloc(seg->lines, size * sizeof *seg->lines);
+	if (l != NULL)
+		seg->lines = l;
+	if (w == NULL || p == NULL || l == NULL)
+		return -1;
+	seg->size = size;
+	return 0;
+}
+
+/*
+ * Add n blank words at index i of a segment.
+ */
+static int
+segment_open(struct hex_segment *seg, int i, int n, unsigned short blank)
+{
+	int j;
+
+	if (segment_reserve(seg, seg->count + n) < 0)
+		return -1;
+	memmove(seg->words + i + n, seg->words + i,
+		(seg->count - i) * sizeof *seg->words);
+	memmove(seg->present + i + n, seg->present + i,
+		(seg->count - i) * sizeof *seg->present);
+	memmove(seg->lines + i + n, seg->lines + i,
+		(seg->count - i) * sizeof *seg->lines);
+	for (j = i; j < i + n; j++) {
+		seg->words[j] = blank;
+		seg->present[j] = 0;
+		seg->lines[j] = 0;
+	}
+	seg->count += n;
+	return 0;
+}
+
+/*
+ * Join segment i and the one after it, which starts where i ends.
+ */
+static int
+segment_join(struct hex_space *s, int i)
+{
+	struct hex_segment *a = &s->segments[i];
+	struct hex_segment *b = &s->segments[i + 1];
+
+	if (segment_reserve(a, a->count + b->count) < 0)
+		return -1;
+	memcpy(a->words + a->count, b->words, b->count * sizeof *b->words);
+	memcpy(a->present + a->count, b->present,
+		b->count * sizeof *b->present);
+	memcpy(a->lines + a->count, b->lines, b->count * sizeof *b->lines);
+	a->count += b->count;
+	segment_free(b);
+	memmove(b, b + 1, (s->count - i - 2) * sizeof *b);
+	s->count--;
+	return 0;
+}
+
+/*
+ * Find the word at an address in a space, adding it if it's new.
+ * Sets *segp to its segment and returns its index there, or -1 when
+ * out of memory.  want is how many words from there on the caller is
+ * about to write; when the last segment grows, it grows by that many
+ * if nothing is in the way.
+ */
+static int
+word_slot(struct hex_space *s, unsigned long address, int want,
+	struct hex_segment **segp)
+{
+	struct hex_segment *seg;
+	struct hex_segment *next;
+	int lo, hi, mid;
+	int i;
+
+	/* Records mostly follow one another, so try the last segment. */
+	if (s->last < s->count) {
+		seg = &s->segments[s->last];
+		if (address >= seg->address &&
+		    address < seg->address + seg->count) {
+			*segp = seg;
+			return address - seg->address;
+		}
+		next = s->last + 1 < s->count ? seg + 1 : NULL;
+		if (address == seg->address + seg->count &&
+		    (next == NULL || next->address > address + 1)) {
+			if (next != NULL && address + want >= next->address)
+				want = next->address - address - 1;
+			i = seg->count;
+			if (segment_open(seg, i, want, s->blank) < 0)
+				return -1;
+			*segp = seg;
+			return i;
+		}
+	}
+
+	/* lo is the first segment starting after address. */
+	lo = 0;
+	hi = s->count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (s->segments[mid].address <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	i = lo - 1;
+	if (i >= 0) {
+		seg = &s->segments[i];
+		if (address < seg->address + seg->count) {
+			s->last = i;
+			*segp = seg;
+			return address - seg->address;
+		}
+		if (address == seg->address + seg->count) {
+			if (segment_open(seg, seg->count, 1, s->blank) < 0)
+				return -1;
+			if (lo < s->count &&
+			    s->segments[lo].address == address + 1 &&
+			    segment_join(s, i) < 0)
+				return -1;
+			s->last = i;
+			*segp = &s->segments[i];
+			return address - seg->address;
+		}
+	}
+
+	if (lo < s->count && s->segments[lo].address == address + 1) {
+		seg = &s->segments[lo];
+		if (segment_open(seg, 0, 1, s->blank) < 0)
+			return -1;
+		seg->address--;
+		s->last = lo;
+		*segp = seg;
+		return 0;
+	}
+
+	/* A new segment at lo. */
+	if (s->count == s->size) {
+		int size = s->size ? 2 * s->size : 8;
+		struct hex_segment *n;
+
+		n = realloc(s->segments, size * sizeof *n);
+		if (n == NULL)
+			return -1;
+		s->segments = n;
+		s->size = size;
+	}
+	memmove(s->segments + lo + 1, s->segments + lo,
+		(s->count - lo) * sizeof *s->segments);
+	s->count++;
+	seg = &s->segments[lo];
+	memset(seg, 0, sizeof *seg);
+	seg->address = address;
+	if (segment_open(seg, 0, 1, s->blank) < 0)
+		return -1;
+	s->last = lo;
+	*segp = seg;
+	return 0;
+}
+
+/*
+ * Which space a word of a HEX file is in, and its offset there.
+ */
+/* Where each space starts, in words of a HEX file, and its size. */
+static const unsigned long space_base[HEX_SPACES] = {
+	0x0000, 0x8000, 0xf000
+};
+static const unsigned long space_words[HEX_SPACES] = {
+	0x8000, 0x1000, 0x1000
+};
+
+static int
+word_space(unsigned long word, unsigned long *address)
+{
+	int s;
+
+	for (s = 0; s < HEX_SPACES; s++)
+		if (word >= space_base[s] &&
+		    word < space_base[s] + space_words[s]) {
+			*address = word - space_base[s];
+			return s;
+		}
+	return -1;
+}
+
+/* The bits of a word for a mask of its bytes, 1 low and 2 high. */
+#define	BYTE_BITS(mask)	(((mask) & 1 ? 0x00ff : 0) | ((mask) & 2 ? 0xff00 : 0))
+
+/*
+ * Say which byte of a word was given twice when it shouldn't be.
+ */
+static int
+given_twice(struct hex_image *im, struct hex_segment *seg, int i, int clash,
+	unsigned value, unsigned long byte_address, int lineno, char *error)
+{
+	int b;
+
+	for (b = 0; b < 2; b++)
+		if ((clash & (1 << b)) && (im->merge == HEX_MERGE_NONE ||
+		    ((seg->words[i] ^ value) & BYTE_BITS(1 << b))))
+			break;
+	sprintf(error, "line %d: address %05lx was already given as %02x "
+			"on line %d",
+		lineno, byte_address + b, seg->words[i] >> (8 * b) & 0xff,
+		seg->lines[i]);
+	return -1;
+}
+
+/*
+ * Put n bytes of a HEX file in the image.  Returns 0, or -1 with a
+ * message in error.
+ */
+int
+hex_image_put(struct hex_image *im, unsigned long byte_address,
+	const unsigned char *bytes, int n, int lineno, char *error)
+{
+	struct hex_segment *seg;
+	unsigned long address;
+	unsigned value;
+	unsigned bits;
+	int space;
+	int mask;
+	int clash;
+	int want;
+	int i;
+	int k;
+
+	seg = NULL;
+	i = 0;
+	for (k = 0; k < n; k += mask == 3 ? 2 : 1) {
+		/* A word at a time, unless the record splits one. */
+		if ((byte_address + k) & 1) {
+			mask = 2;
+			value = bytes[k] << 8;
+		} else if (k + 1 < n) {
+			mask = 3;
+			value = bytes[k] | bytes[k + 1] << 8;
+		} else {
+			mask = 1;
+			value = bytes[k];
+		}
+
+		/* Stay in the same segment while the words follow on. */
+		if (seg != NULL && i + 1 < seg->count)
+			i++;
+		else {
+			space = word_space((byte_address + k) >> 1, &address);
+			if (space < 0) {
+				sprintf(error, "line %d: address %05lx is in "
+						"no memory space",
+					lineno, byte_address + k);
+				return -1;
+			}
+			want = (n - k + 1) / 2;
+			if (want > space_words[space] - address)
+				want = space_words[space] - address;
+			i = word_slot(&im->space[space], address, want,
+				&seg);
+			if (i < 0) {
+				sprintf(error, "line %d: out of memory",
+					lineno);
+				return -1;
+			}
+		}
+
+		clash = seg->present[i] & mask;
+		if (clash && (im->merge == HEX_MERGE_NONE ||
+		    (im->merge == HEX_MERGE_SAME &&
+		    ((seg->words[i] ^ value) & BYTE_BITS(clash)))))
+			return given_twice(im, seg, i, clash, value,
+				(byte_address + k) & ~1UL, lineno, error);
+		bits = BYTE_BITS(mask);
+		seg->words[i] = (seg->words[i] & ~bits) | value;
+		seg->present[i] |= mask;
+		seg->lines[i] = lineno;
+	}
+	return 0;
+}
+
+/*
+ * The word at an address in a space, or -1 if the image has none
+ * there.  Bytes that weren't given read as blank.
+ */
+int
+hex_image_word(struct hex_image *im, int space, unsigned long address,
+	int *lineno)
+{
+	struct hex_space *s = &im->space[space];
+	int lo, hi, mid;
+	struct hex_segment *seg;
+
+	lo = 0;
+	hi = s->count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (s->segments[mid].address <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return -1;
+	seg = &s->segments[lo - 1];
+	if (address >= seg->address + seg->count)
+		return -1;
+	if (lineno != NULL)
+		*lineno = seg->lines[address - seg->address];
+	return seg->words[address - seg->address];
+}
+
+/*
+ * Put everything in src into dst, as if src's records came after
+ * dst's.  If that gives any byte twice when it shouldn't, returns -1
+ * with the message for the earliest such line in error and its number
+ * in *lineno.
+ */
+int
+hex_image_merge(struct hex_image *dst, struct hex_image *src, int *lineno,
+	char *error)
+{
+	struct hex_segment *from;
+	struct hex_segment *seg;
+	unsigned long address;
+	int clash;
+	int bits;
+	int s;
+	int f;
+	int i;
+	int j;
+
+	*lineno = 0;
+	for (s = 0; s < HEX_SPACES; s++) {
+		for (f = 0; f < src->space[s].count; f++) {
+			from = &src->space[s].segments[f];
+			for (j = 0; j < from->count; j++) {
+				if (from->present[j] == 0)
+					continue;
+				address = from->address + j;
+				i = word_slot(&dst->space[s], address,
+					from->count - j, &seg);
+				if (i < 0) {
+					sprintf(error, "out of memory");
+					*lineno = from->lines[j];
+					return -1;
+				}
+				clash = seg->present[i] & from->present[j];
+				if (clash && (dst->merge == HEX_MERGE_NONE ||
+				    (dst->merge == HEX_MERGE_SAME &&
+				    ((seg->words[i] ^ from->words[j]) &
+				    BYTE_BITS(clash))))) {
+					if (*lineno == 0 ||
+					    from->lines[j] < *lineno) {
+						*lineno = from->lines[j];
+						given_twice(dst, seg, i, clash,
+							from->words[j],
+							2 * (address +
+							space_base[s]),
+							*lineno, error);
+					}
+					continue;
+				}
+				bits = BYTE_BITS(from->present[j]);
+				seg->words[i] = (seg->words[i] & ~bits) |
+					(from->words[j] & bits);
+				seg->present[i] |= from->present[j];
+				seg->lines[i] = from->lines[j];
+			}
+		}
+	}
+	return *lineno == 0 ? 0 : -1;
+}
+
+/*
+ * Decoding hex digits.
+ *
+ * A decoder turns 2n hex digits into n bytes and returns their sum,
+ * or -1 if it finds something that isn't a hex digit.  The vector ones
+ * do 16 or 32 digits a step and leave the tail to the table.  The best
+ * one this CPU has is picked the first time it's needed.
+ */
+static signed char hexval[256];
+
+static void
+hexval_init()
+{
+	int c;
+
+	for (c = 0; c < 256; c++)
+		hexval[c] = -1;
+	for (c = 0; c < 10; c++)
+		hexval['0' + c] = c;
+	for (c = 0; c < 6; c++) {
+		hexval['a' + c] = 10 + c;
+		hexval['A' + c] = 10 + c;
+	}
+}
+
+static int
+decode_scalar(const char *hex, unsigned char *out, int n)
+{
+	int hi, lo;
+	int sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < n; i++) {
+		hi = hexval[(unsigned char)hex[2 * i]];
+		lo = hexval[(unsigned char)hex[2 * i + 1]];
+		if ((hi | lo) < 0)
+			return -1;
+		out[i] = hi << 4 | lo;
+		sum += out[i];
+	}
+	return sum;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define	HEX_X86
+#include <immintrin.h>
+
+/*
+ * Each step: find the digits and the letters (either case, by setting
+ * bit 5), turn them into nibbles, and join pairs of nibbles, which are
+ * the low and high bytes of 16-bit lanes, into bytes.
+ */
+__attribute__((target("sse2")))
+static int
+decode_sse2(const char *hex, unsigned char *out, int n)
+{
+	const __m128i below0 = _mm_set1_epi8('0' - 1);
+	const __m128i above9 = _mm_set1_epi8('9' + 1);
+	const __m128i belowa = _mm_set1_epi8('a' - 1);
+	const __m128i abovef = _mm_set1_epi8('f' + 1);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i tena = _mm_set1_epi8('a' - 10);
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i low = _mm_set1_epi16(0x00ff);
+	__m128i v, l, digit, alpha, nib, b;
+	__m128i total = _mm_setzero_si128();
+	int tail;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(hex + 2 * i));
+		l = _mm_or_si128(v, lower);
+		digit = _mm_and_si128(_mm_cmpgt_epi8(v, below0),
+			_mm_cmpgt_epi8(above9, v));
+		alpha = _mm_and_si128(_mm_cmpgt_epi8(l, belowa),
+			_mm_cmpgt_epi8(abovef, l));
+		if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff)
+			return -1;
+		nib = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(v, zero)),
+			_mm_and_si128(alpha, _mm_sub_epi8(l, tena)));
+		b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nib, low), 4),
+			_mm_srli_epi16(nib, 8));
+		b = _mm_packus_epi16(b, _mm_setzero_si128());
+		_mm_storel_epi64((__m128i *)(out + i), b);
+		total = _mm_add_epi64(total, _mm_sad_epu8(b,
+			_mm_setzero_si128()));
+	}
+	tail = decode_scalar(hex + 2 * i, out + i, n - i);
+	if (tail < 0)
+		return -1;
+	return _mm_cvtsi128_si32(total) + tail;
+}
+
+__attribute__((target("avx2")))
+static int
+decode_avx2(const char *hex, unsigned char *out, int n)
+{
+	const __m256i below0 = _mm256_set1_epi8('0' - 1);
+	const __m256i above9 = _mm256_set1_epi8('9' + 1);
+	const __m256i belowa = _mm256_set1_epi8('a' - 1);
+	const __m256i abovef = _mm256_set1_epi8('f' + 1);
+	const __m256i zero = _mm256_set1_epi8('0');
+	const __m256i tena = _mm256_set1_epi8('a' - 10);
+	const __m256i lower = _mm256_set1_epi8(0x20);
+	const __m256i low = _mm256_set1_epi16(0x00ff);
+	__m256i v, l, digit, alpha, nib, b;
+	__m256i total = _mm256_setzero_si256();
+	int tail;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(hex + 2 * i));
+		l = _mm256_or_si256(v, lower);
+		digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, below0),
+			_mm256_cmpgt_epi8(above9, v));
+		alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, belowa),
+			_mm256_cmpgt_epi8(abovef, l));
+		if (_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != -1)
+			return -1;
+		nib = _mm256_or_si256(
+			_mm256_and_si256(digit, _mm256_sub_epi8(v, zero)),
+			_mm256_and_si256(alpha, _mm256_sub_epi8(l, tena)));
+		b = _mm256_or_si256(
+			_mm256_slli_epi16(_mm256_and_si256(nib, low), 4),
+			_mm256_srli_epi16(nib, 8));
+		/* Packing works per 128-bit half; bring the halves together. */
+		b = _mm256_packus_epi16(b, _mm256_setzero_si256());
+		b = _mm256_permute4x64_epi64(b, 0x08);
+		_mm_storeu_si128((__m128i *)(out + i),
+			_mm256_castsi256_si128(b));
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(b,
+			_mm256_setzero_si256()));
+	}
+	tail = decode_scalar(hex + 2 * i, out + i, n - i);
+	if (tail < 0)
+		return -1;
+	return _mm256_extract_epi32(total, 0) + _mm256_extract_epi32(total, 2) +
+		tail;
+}
+#endif
+
+static int (*decode)(const char *, unsigned char *, int);
+static pthread_once_t hexval_once = PTHREAD_ONCE_INIT;
+static pthread_once_t decode_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Use one decoder, e.g. to compare them.  Returns -1 if this build or
+ * CPU doesn't have it.
+ */
+int
+hex_decoder(int which)
+{
+	pthread_once(&hexval_once, hexval_init);
+	switch (which) {
+	    case HEX_DECODE_SCALAR:
+		decode = decode_scalar;
+		return 0;
+#ifdef HEX_X86
+	    case HEX_DECODE_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return -1;
+		decode = decode_sse2;
+		return 0;
+	    case HEX_DECODE_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return -1;
+		decode = decode_avx2;
+		return 0;
+#endif
+	}
+	return -1;
+}
+
+/*
+ * Pick the best decoder, unless one was asked for.  Parsers can start
+ * up on several threads at once, so this only ever runs once.
+ */
+static void
+decode_init()
+{
+	if (decode == NULL &&
+	    hex_decoder(HEX_DECODE_AVX2) < 0 &&
+	    hex_decoder(HEX_DECODE_SSE2) < 0)
+		hex_decoder(HEX_DECODE_SCALAR);
+}
+
+void
+hex_parser_init(struct hex_parser *p, struct hex_image *im)
+{
+	memset(p, 0, sizeof *p);
+	p->image = im;
+	p->lineno = 1;
+	pthread_once(&decode_once, decode_init);
+}
+
+/*
+ * Say where the first bad digit of a line is.
+ */
+static int
+bad_digit(struct hex_parser *p, const char *line, int len)
+{
+	int i;
+
+	for (i = 1; i < len; i++)
+		if (hexval[(unsigned char)line[i]] < 0)
+			break;
+	sprintf(p->error, "line %d contains invalid hex digit %c",
+		p->lineno, line[i]);
+	return -1;
+}
+
+/*
+ * Interpret one line, without its newline.
+ */
+static int
+hex_line(struct hex_parser *p, const char *line, int len)
+{
+	unsigned char bytes[(HEX_LINE_MAX - 1) / 2];
+	unsigned address;
+	int count;
+	int type;
+	int sum;
+
+	while (len > 0 && line[len - 1] == '\r')
+		len--;
+	if (len == 0)
+		return 0;
+
+	if (p->done) {
+		sprintf(p->error, "line %d occurs after the end of file "
+				"record", p->lineno);
+		return -1;
+	}
+
+	if (line[0] != ':') {
+		sprintf(p->error, "line %d doesn't begin with a ':'",
+			p->lineno);
+		return -1;
+	}
+
+	if (len < 11) {
+		sprintf(p->error, "line %d too short (%d)", p->lineno, len);
+		return -1;
+	}
+
+	if (decode_scalar(line + 1, bytes, 1) < 0)
+		return bad_digit(p, line, 3);
+	count = bytes[0];
+	if (len != 11 + 2 * count) {
+		sprintf(p->error, "line %d wrong length.  (%d %d)",
+			p->lineno, len, 11 + 2 * count);
+		return -1;
+	}
+
+	sum = (*decode)(line + 1, bytes, count + 5);
+	if (sum < 0)
+		return bad_digit(p, line, len);
+	if ((sum & 0xff) != 0) {
+		sprintf(p->error, "line %d checksum error.  %02x  %02x",
+			p->lineno, 0xff & (bytes[count + 4] - sum),
+			bytes[count + 4]);
+		return -1;
+	}
+
+	address = bytes[1] << 8 | bytes[2];
+	type = bytes[3];
+
+	switch (type) {
+	    case 0:
+		if (hex_image_put(p->image, p->base + address, bytes + 4,
+		    count, p->lineno, p->error) < 0)
+			return -1;
+		break;
+
+	    case 1:
+		if (count != 0)
+			goto bad;
+		p->done = 1;
+		break;
+
+	    case 2:
+	    case 4:
+		if (count != 2 || address != 0)
+			goto bad;
+		p->base = (unsigned long)(bytes[4] << 8 | bytes[5]) <<
+			(type == 2 ? 4 : 16);
+		break;
+
+	    case 3:
+	    case 5:
+		if (count != 4)
+			goto bad;
+		p->image->has_start = 1;
+		p->image->start = (unsigned long)bytes[4] << 24 |
+			(unsigned long)bytes[5] << 16 | bytes[6] << 8 |
+			bytes[7];
+		break;
+
+	    default:
+		sprintf(p->error, "line %d invalid type code %d",
+			p->lineno, type);
+		return -1;
+	}
+
+	if (p->record != NULL)
+		(*p->record)(p, type, address, bytes + 4, count);
+	return 0;
+
+    bad:
+	sprintf(p->error, "line %d unknown type %d record, address = %x, "
+			"nbytes = %d",
+		p->lineno, type, address, count);
+	return -1;
+}
+
+/*
+ * Save the start of a line that goes on in the next piece.
+ */
+static int
+hold_line(struct hex_parser *p, const char *data, long n)
+{
+	if (p->len + n > (long)sizeof p->line) {
+		sprintf(p->error, "line %d is too long", p->lineno);
+		return -1;
+	}
+	memcpy(p->line + p->len, data, n);
+	p->len += n;
+	return 0;
+}
+
+/*
+ * Parse the next n bytes of a HEX file.  Lines can be split anywhere
+ * between calls; whole lines are read where they lie.  Returns 0, or
+ * -1 with a message in p->error.
+ */
+int
+hex_parse(struct hex_parser *p, const char *data, long n)
+{
+	const char *end = data + n;
+	const char *nl;
+	int r;
+
+	while (data < end) {
+		nl = memchr(data, '\n', end - data);
+		if (nl == NULL)
+			return hold_line(p, data, end - data);
+		if (p->len > 0) {
+			if (hold_line(p, data, nl - data) < 0)
+				return -1;
+			r = hex_line(p, p->line, p->len);
+			p->len = 0;
+		} else if (nl - data > (long)sizeof p->line) {
+			sprintf(p->error, "line %d is too long", p->lineno);
+			return -1;
+		} else
+			r = hex_line(p, data, nl - data);
+		if (r < 0)
+			return -1;
+		p->lineno++;
+		data = nl + 1;
+	}
+	return 0;
+}
+
+/*
+ * The end of the file.  A last line without a newline is fine.
+ */
+int
+hex_parse_end(struct hex_parser *p)
+{
+	if (hex_line(p, p->line, p->len) < 0)
+		return -1;
+	p->len = 0;
+	if (!p->done) {
+		sprintf(p->error, "no type 1 record found");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read a whole HEX file from fd.  A plain file is mapped and parsed
+ * where it lies; anything else is read in large blocks.
+ */
+int
+hex_read(struct hex_parser *p, int fd)
+{
+	struct stat st;
+	char *map;
+	char *buf;
+	ssize_t n;
+	int r;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			r = hex_parse(p, map, st.st_size);
+			munmap(map, st.st_size);
+			if (r < 0)
+				return -1;
+			return hex_parse_end(p);
+		}
+	}
+
+	buf = malloc(HEX_READ_SIZE);
+	if (buf == NULL) {
+		sprintf(p->error, "out of memory");
+		return -1;
+	}
+	while ((n = read(fd, buf, HEX_READ_SIZE)) > 0)
+		if (hex_parse(p, buf, n) < 0)
+			break;
+	free(buf);
+	if (n < 0) {
+		sprintf(p->error, "read error on line %d: %s",
+			p->lineno, strerror(errno));
+		return -1;
+	}
+	if (n > 0)
+		return -1;
+	return hex_parse_end(p);
+}
+
+/*
+ * Parsing one big file on several threads.
+ *
+ * The file is cut into pieces at line ends.  A first pass over each
+ * piece counts its lines, so the next knows its first line number,
+ * and finds the last extended address record, which is in force at
+ * the start of the pieces after it.  Then each piece is parsed into
+ * an image of its own, and the images are merged in order.  Of all
+ * the errors found, the one on the earliest line is reported, which
+ * is what reading the file straight through would have said.
+ */
+struct piece {
+	const char *data;
+	long len;
+	int lines;			/* newlines in the piece */
+	int first;			/* first line with anything on it */
+	int has_base;
+	unsigned long base;		/* last extended address in it */
+	int last;			/* the piece at the end of the file */
+	int failed;
+	struct hex_image image;
+	struct hex_parser parser;
+};
+
+struct pieces {
+	struct piece *piece;
+	int count;
+	int next;			/* next one for a thread to take */
+	pthread_mutex_t lock;
+	void (*work)(struct piece *);
+};
+
+static void
+piece_scan(struct piece *pc)
+{
+	const char *p = pc->data;
+	const char *end = pc->data + pc->len;
+	const char *nl;
+	long len;
+	int digits[4];
+	int i;
+
+	pc->lines = 0;
+	pc->first = 0;
+	pc->has_base = 0;
+	for (; p < end; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL)
+			nl = end;
+		len = nl - p;
+		while (len > 0 && p[len - 1] == '\r')
+			len--;
+		if (len > 0 && pc->first == 0)
+			pc->first = pc->lines + 1;
+		if (nl < end)
+			pc->lines++;
+		if (len != 15 || (memcmp(p, ":02000002", 9) != 0 &&
+		    memcmp(p, ":02000004", 9) != 0))
+			continue;
+		for (i = 0; i < 4; i++)
+			digits[i] = hexval[(unsigned char)p[9 + i]];
+		if ((digits[0] | digits[1] | digits[2] | digits[3]) < 0)
+			continue;
+		pc->has_base = 1;
+		pc->base = (unsigned long)(digits[0] << 12 | digits[1] << 8 |
+			digits[2] << 4 | digits[3]) << (p[8] == '2' ? 4 : 16);
+	}
+}
+
+static void
+piece_parse(struct piece *pc)
+{
+	struct hex_parser *p = &pc->parser;
+
+	pc->failed = hex_parse(p, pc->data, pc->len) < 0;
+	/* A last line with no newline. */
+	if (!pc->failed && pc->last && p->len > 0)
+		pc->failed = hex_parse(p, "\n", 1) < 0;
+}
+
+static void *
+piece_thread(void *arg)
+{
+	struct pieces *ps = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&ps->lock);
+		i = ps->next++;
+		pthread_mutex_unlock(&ps->lock);
+		if (i >= ps->count)
+			return NULL;
+		(*ps->work)(&ps->piece[i]);
+	}
+}
+
+/*
+ * Do work on every piece, on up to n threads.
+ */
+static void
+piece_run(struct pieces *ps, int n, void (*work)(struct piece *))
+{
+	pthread_t tid[HEX_THREADS_MAX];
+	int started;
+
+	ps->next = 0;
+	ps->work = work;
+	if (n > ps->count)
+		n = ps->count;
+	for (started = 0; started < n - 1; started++)
+		if (pthread_create(&tid[started], NULL, piece_thread, ps) != 0)
+			break;
+	piece_thread(ps);
+	while (started > 0)
+		pthread_join(tid[--started], NULL);
+}
+
+/*
+ * Parse a whole HEX file that's in memory into an image, on up to n
+ * threads.  Small files are just parsed.  Returns 0, or -1 with a
+ * message in error.
+ */
+int
+hex_parse_split(struct hex_image *im, const char *data, long size,
+	int threads, char *error)
+{
+	struct hex_parser whole;
+	struct pieces ps;
+	struct piece *pc;
+	int lineno;
+	int best;
+	int done;
+	int line;
+	int i;
+	const char *nl;
+	long at;
+	long cut;
+	long end;
+	unsigned long base;
+	char message[sizeof whole.error];
+
+	hex_parser_init(&whole, im);
+	if (threads > HEX_THREADS_MAX)
+		threads = HEX_THREADS_MAX;
+	ps.count = size / HEX_SPLIT_MIN;
+	if (ps.count > threads)
+		ps.count = threads;
+	if (ps.count < 2) {
+		if (hex_parse(&whole, data, size) < 0 ||
+		    hex_parse_end(&whole) < 0) {
+			strcpy(error, whole.error);
+			return -1;
+		}
+		return 0;
+	}
+
+	ps.piece = calloc(ps.count, sizeof *ps.piece);
+	if (ps.piece == NULL) {
+		sprintf(error, "out of memory");
+		return -1;
+	}
+	pthread_mutex_init(&ps.lock, NULL);
+	at = 0;
+	for (i = 0; i < ps.count; i++) {
+		pc = &ps.piece[i];
+		pc->data = data + at;
+		if (i == ps.count - 1)
+			end = size;
+		else {
+			cut = size * (i + 1) / ps.count;
+			if (cut < at)
+				cut = at;
+			nl = memchr(data + cut, '\n', size - cut);
+			end = nl == NULL ? size : nl - data + 1;
+		}
+		pc->len = end - at;
+		pc->last = end == size;
+		at = end;
+	}
+	piece_run(&ps, threads, piece_scan);
+
+	lineno = 1;
+	base = 0;
+	for (i = 0; i < ps.count; i++) {
+		pc = &ps.piece[i];
+		hex_image_init(&pc->image);
+		pc->image.merge = im->merge;
+		hex_parser_init(&pc->parser, &pc->image);
+		pc->parser.lineno = lineno;
+		pc->parser.base = base;
+		if (pc->first != 0)
+			pc->first += lineno - 1;
+		lineno += pc->lines;
+		if (pc->has_base)
+			base = pc->base;
+	}
+	piece_run(&ps, threads, piece_parse);
+
+	/*
+	 * Merge, keeping the error on the earliest line.  Lines after the
+	 * end of file record in a later piece come first on a tie, as
+	 * the plain parse checks for that before anything else.
+	 */
+	best = 0;
+	done = 0;
+	for (i = 0; i < ps.count; i++) {
+		pc = &ps.piece[i];
+		if (done && pc->first != 0 &&
+		    (best == 0 || pc->first <= best)) {
+			best = pc->first;
+			sprintf(error, "line %d occurs after the end of file "
+					"record", best);
+		}
+		if (pc->failed && (best == 0 || pc->parser.lineno < best)) {
+			best = pc->parser.lineno;
+			strcpy(error, pc->parser.error);
+		}
+		if (hex_image_merge(im, &pc->image, &line, message) < 0 &&
+		    (best == 0 || line < best)) {
+			best = line;
+			strcpy(error, message);
+		}
+		if (pc->parser.done)
+			done = 1;
+		hex_image_free(&pc->image);
+	}
+	pthread_mutex_destroy(&ps.lock);
+	free(ps.piece);
+	if (best != 0)
+		return -1;
+	if (!done) {
+		sprintf(error, "no type 1 record found");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The binary image format; see hexfile.h.
+ */
+static void
+put_le(unsigned char *p, unsigned long value, int n)
+{
+	while (n-- > 0) {
+		*p++ = value;
+		value >>= 8;
+	}
+}
+
+static unsigned long
+get_le(const unsigned char *p, int n)
+{
+	unsigned long value = 0;
+
+	while (n-- > 0)
+		value = value << 8 | p[n];
+	return value;
+}
+
+#define	FNV_OFFSET	0xcbf29ce484222325ULL
+#define	FNV_PRIME	0x100000001b3ULL
+
+static unsigned long long
+fnv_update(unsigned long long hash, const unsigned char *p, long n)
+{
+	while (n-- > 0)
+		hash = (hash ^ *p++) * FNV_PRIME;
+	return hash;
+}
+
+/*
+ * Write an image in the binary format.  Returns 0, or -1 if the
+ * writing fails.  The hash goes in *hash if that isn't NULL.
+ */
+int
+hex_image_save(struct hex_image *im, FILE *f, unsigned long long *hash)
+{
+	struct hex_bin_header h;
+	struct hex_bin_segment bs;
+	struct hex_segment *seg;
+	unsigned long long fnv;
+	unsigned char word[2];
+	unsigned long words;
+	int segments;
+	int s;
+	int i;
+	int j;
+
+	segments = 0;
+	words = 0;
+	for (s = 0; s < HEX_SPACES; s++) {
+		segments += im->space[s].count;
+		for (i = 0; i < im->space[s].count; i++)
+			words += im->space[s].segments[i].count;
+	}
+
+	/* The hash covers what follows the header, so it goes first. */
+	fnv = FNV_OFFSET;
+	for (s = 0; s < HEX_SPACES; s++)
+		for (i = 0; i < im->space[s].count; i++) {
+			seg = &im->space[s].segments[i];
+			memset(&bs, 0, sizeof bs);
+			bs.space = s;
+			put_le(bs.address, seg->address, 4);
+			put_le(bs.count, seg->count, 4);
+			fnv = fnv_update(fnv, (unsigned char *)&bs, sizeof bs);
+		}
+	for (s = 0; s < HEX_SPACES; s++)
+		for (i = 0; i < im->space[s].count; i++) {
+			seg = &im->space[s].segments[i];
+			for (j = 0; j < seg->count; j++) {
+				put_le(word, seg->words[j], 2);
+				fnv = fnv_update(fnv, word, 2);
+			}
+		}
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, HEX_BIN_MAGIC, sizeof h.magic);
+	put_le(h.version, HEX_BIN_VERSION, 2);
+	put_le(h.segments, segments, 2);
+	put_le(h.words, words, 4);
+	put_le(h.hash, fnv & 0xffffffff, 4);
+	put_le(h.hash + 4, fnv >> 32, 4);
+	fwrite(&h, sizeof h, 1, f);
+	for (s = 0; s < HEX_SPACES; s++)
+		for (i = 0; i < im->space[s].count; i++) {
+			seg = &im->space[s].segments[i];
+			memset(&bs, 0, sizeof bs);
+			bs.space = s;
+			put_le(bs.address, seg->address, 4);
+			put_le(bs.count, seg->count, 4);
+			fwrite(&bs, sizeof bs, 1, f);
+		}
+	for (s = 0; s < HEX_SPACES; s++)
+		for (i = 0; i < im->space[s].count; i++) {
+			seg = &im->space[s].segments[i];
+			for (j = 0; j < seg->count; j++) {
+				put_le(word, seg->words[j], 2);
+				fwrite(word, 2, 1, f);
+			}
+		}
+	if (hash != NULL)
+		*hash = fnv;
+	return ferror(f) ? -1 : 0;
+}
+
+/*
+ * Check that size bytes at data are a whole, undamaged binary image.
+ * Returns how many segments it has, or -1 with a message in error.
+ */
+int
+hex_bin_check(const unsigned char *data, long size,
+	unsigned long long *hash, char *error)
+{
+	const struct hex_bin_header *h = (const void *)data;
+	const struct hex_bin_segment *bs;
+	unsigned long long fnv;
+	unsigned long words;
+	unsigned long end;
+	int segments;
+	int last;
+	int i;
+
+	if (size < (long)sizeof *h ||
+	    memcmp(h->magic, HEX_BIN_MAGIC, sizeof h->magic) != 0) {
+		sprintf(error, "not a binary image");
+		return -1;
+	}
+	if (get_le(h->version, 2) != HEX_BIN_VERSION) {
+		sprintf(error, "binary image version %lu, not %d",
+			get_le(h->version, 2), HEX_BIN_VERSION);
+		return -1;
+	}
+	segments = get_le(h->segments, 2);
+	words = get_le(h->words, 4);
+	if (size != (long)(sizeof *h + segments * sizeof *bs + 2 * words)) {
+		sprintf(error, "binary image is %ld bytes, not %lu",
+			size, (unsigned long)(sizeof *h +
+			segments * sizeof *bs + 2 * words));
+		return -1;
+	}
+	fnv = fnv_update(FNV_OFFSET, data + sizeof *h, size - sizeof *h);
+	if (get_le(h->hash, 4) != (fnv & 0xffffffff) ||
+	    get_le(h->hash + 4, 4) != fnv >> 32) {
+		sprintf(error, "binary image is damaged (bad hash)");
+		return -1;
+	}
+
+	bs = (const void *)(data + sizeof *h);
+	last = 0;
+	end = 0;
+	for (i = 0; i < segments; i++, bs++) {
+		if (bs->space >= HEX_SPACES || bs->space < last ||
+		    (bs->space == last && i > 0 &&
+		    get_le(bs->address, 4) <= end) ||
+		    get_le(bs->count, 4) == 0 ||
+		    get_le(bs->address, 4) + get_le(bs->count, 4) >
+		    space_words[bs->space]) {
+			sprintf(error, "binary image segment %d is bad", i);
+			return -1;
+		}
+		last = bs->space;
+		end = get_le(bs->address, 4) + get_le(bs->count, 4);
+		words -= get_le(bs->count, 4);
+	}
+	if (words != 0) {
+		sprintf(error, "binary image word count is wrong");
+		return -1;
+	}
+	if (hash != NULL)
+		*hash = fnv;
+	return segments;
+}
+
+/*
+ * Find segment i of a binary image that hex_bin_check() passed.
+ */
+void
+hex_bin_segment(const unsigned char *data, int i, struct hex_bin_run *run)
+{
+	const struct hex_bin_header *h = (const void *)data;
+	const struct hex_bin_segment *bs;
+	const unsigned char *words;
+	int segments;
+	int k;
+
+	segments = get_le(h->segments, 2);
+	bs = (const void *)(data + sizeof *h);
+	words = (const unsigned char *)(bs + segments);
+	for (k = 0; k < i; k++)
+		words += 2 * get_le(bs[k].count, 4);
+	run->space = bs[i].space;
+	run->address = get_le(bs[i].address, 4);
+	run->count = get_le(bs[i].count, 4);
+	run->words = words;
+}
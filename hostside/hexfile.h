@@ -0,0 +1,152 @@
+/*
+ * Read Intel HEX into a sparse image of a PIC's memories.
+ *
+ * The image keeps each memory space as a sorted list of segments, each
+ * a run of consecutive words.  Addresses in a segment are word offsets
+ * from the start of its space, the way the loader counts them:
+ *
+ *	HEX byte address	space		offset
+ *	0x00000 - 0x0ffff	program		word
+ *	0x10000 - 0x11fff	config		word - 0x8000
+ *	0x1e000 - 0x1ffff	EEPROM		word - 0xf000
+ *
+ * A word can be built from records in any order.  A byte given twice
+ * is handled by the image's merge policy.
+ *
+ * The parser is fed the file in pieces of any size, so it works from
+ * a pipe, a buffer or a file.  Lines are decoded where they lie, with
+ * SSE2 or AVX2 when the CPU has them.  A large file in memory can be
+ * parsed on several threads with hex_parse_split().
+ */
+
+#ifndef HEXFILE_H
+#define	HEXFILE_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	HEX_PROGRAM	0
+#define	HEX_CONFIG	1
+#define	HEX_EEPROM	2
+#define	HEX_SPACES	3
+
+/* What happens when a byte is given a second time. */
+#define	HEX_MERGE_SAME	0	/* allowed if the value is the same */
+#define	HEX_MERGE_LAST	1	/* the later value wins */
+#define	HEX_MERGE_NONE	2	/* never allowed */
+
+struct hex_segment {
+	unsigned long address;		/* offset of words[0] in the space */
+	int count;			/* words in use */
+	int size;			/* words allocated */
+	unsigned short *words;
+	unsigned char *present;		/* 1: low byte given, 2: high */
+	int *lines;			/* input line of each word */
+};
+
+struct hex_space {
+	struct hex_segment *segments;	/* sorted, never adjacent */
+	int count;
+	int size;
+	int last;			/* segment written last */
+	unsigned short blank;		/* value of a byte not given */
+};
+
+struct hex_image {
+	struct hex_space space[HEX_SPACES];
+	int merge;			/* HEX_MERGE_... */
+	int has_start;
+	unsigned long start;		/* from a type 3 or 5 record */
+};
+
+#define	HEX_LINE_MAX	(11 + 2 * 255)	/* ':' count addr type data sum */
+#define	HEX_READ_SIZE	(1 << 20)	/* read()s when a file can't be mapped */
+#define	HEX_SPLIT_MIN	(1 << 20)	/* smallest piece for hex_parse_split() */
+#define	HEX_THREADS_MAX	64
+
+/* For hex_decoder() */
+#define	HEX_DECODE_SCALAR	0
+#define	HEX_DECODE_SSE2		1
+#define	HEX_DECODE_AVX2		2
+
+struct hex_parser {
+	struct hex_image *image;
+	int lineno;			/* of the line being read */
+	int done;			/* the end of file record was seen */
+	unsigned long base;		/* from a type 2 or 4 record */
+	int len;			/* of a line split between pieces */
+	char line[HEX_LINE_MAX + 2];
+	char error[160];
+	/* Called for each good record if set, e.g. to list them. */
+	void (*record)(struct hex_parser *, int type, unsigned address,
+		unsigned char *bytes, int count);
+};
+
+/*
+ * The binary image format, which hexcrack -b writes and the loader
+ * maps and reads in place.  Numbers are little-endian.
+ *
+ *	header		struct hex_bin_header
+ *	segments	struct hex_bin_segment, in space then address order
+ *	words		two bytes each, for each segment in turn
+ *
+ * The hash is 64-bit FNV-1a over everything after the header, so two
+ * images with the same hash have the same contents.
+ */
+#define	HEX_BIN_MAGIC	"\211PIC"	/* not a letter, unlike text input */
+#define	HEX_BIN_VERSION	1
+
+struct hex_bin_header {
+	char magic[4];
+	unsigned char version[2];
+	unsigned char segments[2];
+	unsigned char words[4];
+	unsigned char hash[8];
+};
+
+struct hex_bin_segment {
+	unsigned char space;		/* HEX_PROGRAM ... */
+	unsigned char unused[3];
+	unsigned char address[4];	/* offset in the space */
+	unsigned char count[4];		/* words */
+};
+
+/* A segment of a binary image, as hex_bin_segment() finds it. */
+struct hex_bin_run {
+	int space;
+	unsigned long address;
+	unsigned long count;
+	const unsigned char *words;	/* 2 * count bytes */
+};
+
+void hex_image_init(struct hex_image *);
+void hex_image_free(struct hex_image *);
+int hex_image_put(struct hex_image *, unsigned long byte_address,
+	const unsigned char *bytes, int n, int lineno, char *error);
+int hex_image_word(struct hex_image *, int space, unsigned long address,
+	int *lineno);
+int hex_image_merge(struct hex_image *dst, struct hex_image *src,
+	int *lineno, char *error);
+
+void hex_parser_init(struct hex_parser *, struct hex_image *);
+int hex_parse(struct hex_parser *, const char *data, long n);
+int hex_parse_end(struct hex_parser *);
+int hex_read(struct hex_parser *, int fd);
+int hex_parse_split(struct hex_image *, const char *data, long size,
+	int threads, char *error);
+int hex_decoder(int which);
+
+int hex_image_save(struct hex_image *, FILE *, unsigned long long *hash);
+int hex_bin_check(const unsigned char *data, long size,
+	unsigned long long *hash, char *error);
+void hex_bin_segment(const unsigned char *data, int i,
+	struct hex_bin_run *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
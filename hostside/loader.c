@@ -6,17 +6,38 @@
  * Built and tested ona PIC 12F1822
  */
 
+#define	_GNU_SOURCE		/* struct ucred */
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <glob.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <limits.h>
 #include "commands.h"
+#include "hexfile.h"
 
 char *myname;
 char *portbasename = "/dev/ttyS";
 char *portname;
+#define	MAX_PORTS	32
+char *ports[MAX_PORTS];	// from -p; more than one is gang mode
+int nports;
 FILE *input;		// input data is here.
 int fd;			// arduino is here.
 
@@ -28,374 +49,3542 @@ int erase_mode;
 
 int verbose;
 int verify;
+int incremental;	/* rewrite only the rows that changed */
+char *serve_path;	/* -d: run jobs sent to this socket */
+char *client_path;	/* -s: send the job to the daemon on this socket */
+int serving;		/* keep the link up after each job */
+int job_argc;		/* the arguments a client sends, file aside */
+char **job_argv;
 #define	PRINT_CONFIG	0x1
 #define	PRINT_PROGRAM	0x2
 #define	PRINT_DATA	0x4
+#define	PRINT_ALL	0x8
 int print;
 int run;
 
 #define	PIC_NUMBER_OF_LATCHES	16
+#define	PIC_ERASE_ROW		32	/* words one Row Erase clears */
+#define	PIC_PROGRAM_WORDS	2048
+#define	PIC_CONFIG_WORDS	11
+#define	PIC_DATA_BYTES		256
 
-static void
-set_baud()
-{
-	int r;
-	struct termios tdata;
-
-	r = tcgetattr(fd, &tdata);
-	if (r != 0) {
-		fprintf(stderr, "%s: failed to get tty attrs\n",
-			myname);
-		perror("tcgetattr");
-		exit(1);
-	}
-
-	if (verbose) {
-		printf("Setting baud rate to 9600\n");
-		printf("B9600 = %d, Speed = %d\n", B9600, cfgetispeed(&tdata));
-	}
-
-	r = cfsetispeed(&tdata, B9600);
-	if (r != 0) {
-		fprintf(stderr, "%s: failed to set tty ispeed\n",
-			myname);
-		exit(1);
-	}
+/*
+ * Letters of the optional commands the arduino says it implements.
+ * Filled in by the handshake.
+ */
+char capabilities[32];
+int window;		/* arduino receive buffer size, 0 if none */
+int stop_and_wait;	/* wait for each command before sending the next */
+int ascii_only;		/* don't use binary frames */
+int framed;		/* talking to the arduino in binary frames */
+int tx_seq;		/* sequence number of our next frame */
 
-	r = cfsetospeed(&tdata, B9600);
-	if (r != 0) {
-		fprintf(stderr, "%s: failed to set tty ospeed\n",
-			myname);
-		exit(1);
-	}
+/*
+ * A gang arduino drives several PICs at once, with the same writes,
+ * and sends back a word from each for every word read.  A target that
+ * fails is given up on and the others carry on.
+ */
+#define	MAX_TARGETS	8
+int targets;		/* PICs on the arduino */
+int live;		/* targets not given up on, a bit each */
 
-	r = tcsetattr(fd, TCSANOW, &tdata);
-	if (r != 0) {
-		fprintf(stderr, "%s: failed to set tty attrs\n",
-			myname);
-		exit(1);
-	}
+/*
+ * Milliseconds since some fixed time, for deadlines.
+ */
+static long
+now_ms()
+{
+	struct timespec ts;
 
-	/*
-	 * Setting the baud rate resets the arduino. Why, I don't know.
-	 * This sleep waits for the arduino to come out of reset.
-	 */
-	sleep(3);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
 }
 
+/*
+ * Transport.  Bytes from the arduino are read in bulk into a ring
+ * buffer.  Bytes for it are gathered up and go out in one writev()
+ * when we next wait for it, or when there are too many.  Every wait
+ * has a deadline; when one passes, io_error says what happened.
+ */
+#define	RX_SIZE		1024		/* power of 2 */
+#define	TX_SIZE		1024
+#define	TX_IOV		64
+#define	REPLY_TIMEOUT	2000		/* ms for anything without its own */
 
-static char ignore_chars[] =
-	{ ' ', '\t', '\r', '\n', };
-static int
-arduino_read()
-{
-	char c;
-	int r;
-	int i;
+#define	IO_TIMEOUT	(-1)
+#define	IO_CLOSED	(-2)
+#define	IO_ERROR	(-3)
 
-	for (;;) {
-		r = read(fd, &c, 1);
-		if (r < 1) {
-			fprintf(stderr, "%s: error reading arduino.\n",
-				myname);
-			exit(1);
-		}
+struct {
+	int error;		/* IO_TIMEOUT, ... */
+	int ms;			/* how long we waited */
+	int err;		/* errno for IO_ERROR */
+} io_error;
 
-		for (i = 0; i < sizeof ignore_chars / sizeof ignore_chars[0];
-		    i++) {
-		    	if (c == ignore_chars[i])
-				goto contin;
-		}
-		return c;
-	    contin:;
-	}
-}
+unsigned char rx_buf[RX_SIZE];
+unsigned int rx_head;		/* next byte in */
+unsigned int rx_tail;		/* next byte out */
 
-/* returns true if it is able to handshake with the arduino. */
-static int
-handshake()
-{
-	int c;
+struct iovec tx_iov[TX_IOV];
+int tx_niov;
+unsigned char tx_buf[TX_SIZE];	/* copies of what the iovecs point at */
+int tx_used;
+int tx_bytes;
 
-	write(fd, "A", 1);
-	c = arduino_read();
+long io_reads, io_writes, io_polls;
 
-	if (c != 'B')
-		return 0;
-	write(fd, "I", 1);
+/*
+ * While a load is running, losing the link goes back to load_image()
+ * to connect again, instead of giving up.
+ */
+jmp_buf link_lost;
+int loading;
 
-	if (verbose)
-		printf("Handshake complete\n");
-	return 1;
-}
+#define	IS_BLANK(c)	((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
 
 /*
- * Enters programming mode on the PIC
+ * Give up on the link to the arduino.
  */
 static void
-enter_program_mode()
-{
-	int c;
-
-	write(fd, "E", 1);
-
-	c = arduino_read();
-	if (c != 'Y') {
-		fprintf(stderr, "%s: failed to enter programming mode.\n",
-			myname);
-		exit(1);
-	}
-
-	if (verbose)
-		printf("Now in programming mode\n");
-}
-
-static char *
-gen_name(char *name)
+link_fail()
 {
-	static char lbuf[128];
-
-	sprintf(lbuf, "%s%s", portbasename, name);
-	return lbuf;
+	if (loading)
+		longjmp(link_lost, 1);
+	exit(1);
 }
 
-void
-l_opentty(char *name)
+/*
+ * Report a failed transfer and give up on the link.
+ */
+static void
+io_fail(char *what)
 {
-	fd = open(name, O_RDWR);
-	if (fd < 0)
-		return;
-
-	if (!isatty(fd)) {
-/*xxx*/printf("not a tty\n");
-		close(fd);
-		return;
+	switch (io_error.error) {
+	    case IO_TIMEOUT:
+		fprintf(stderr, "%s: %s: no answer from the arduino "
+				"in %d ms\n",
+			myname, what, io_error.ms);
+		break;
+	    case IO_CLOSED:
+		fprintf(stderr, "%s: %s: the arduino went away\n",
+			myname, what);
+		break;
+	    default:
+		fprintf(stderr, "%s: %s: %s\n",
+			myname, what, strerror(io_error.err));
+		break;
 	}
-	set_baud();
+	link_fail();
 }
 
-void
-openport(char *portname)
+/*
+ * Send everything gathered so far.
+ */
+static void
+tx_flush()
 {
+	int r;
 	int i;
-	char lbuf[16];
 
-	if (portname) {
-		l_opentty(portname);
-		if (fd > 0) {
-			if (handshake())
-				return;
-			close(fd);
+	while (tx_niov > 0) {
+		r = writev(fd, tx_iov, tx_niov);
+		io_writes++;
+		if (r < 0) {
+			io_error.error = IO_ERROR;
+			io_error.err = errno;
+			io_fail("writing to the arduino");
 		}
-		l_opentty(gen_name(portname));
-		if (fd > 0) {
-			if (handshake())
-				return;
-			close(fd);
+		tx_bytes -= r;
+		for (i = 0; i < tx_niov && r >= tx_iov[i].iov_len; i++)
+			r -= tx_iov[i].iov_len;
+		if (i < tx_niov) {
+			tx_iov[i].iov_base = (char *)tx_iov[i].iov_base + r;
+			tx_iov[i].iov_len -= r;
 		}
-		fprintf(stderr, "%s: cannot open port %s or %s\n",
-			myname,
-			portname,
-			gen_name(portname));
-		exit(1);
+		memmove(tx_iov, tx_iov + i, (tx_niov - i) * sizeof tx_iov[0]);
+		tx_niov -= i;
 	}
+	tx_used = 0;
+	tx_bytes = 0;
+}
 
-	for (i = 0; i < 32; i++) {
-		sprintf(lbuf, "%d", i);
-		l_opentty(gen_name(lbuf));
-		if (fd > 0) {
-			if (handshake())
-				return;
-			close(fd);
+/*
+ * Add a buffer to what goes out next.  Buffers that stay put until
+ * the reply comes back (queued frames) are sent from where they are;
+ * anything else is copied.
+ */
+static void
+tx_add(void *buf, int len, int copy)
+{
+	if (tx_niov == TX_IOV || (copy && tx_used + len > TX_SIZE))
+		tx_flush();
+	if (copy) {
+		if (len > TX_SIZE) {
+			tx_add(buf, len, 0);
+			tx_flush();
+			return;
+		}
+		memcpy(tx_buf + tx_used, buf, len);
+		buf = tx_buf + tx_used;
+		tx_used += len;
+		if (tx_niov > 0 && (char *)tx_iov[tx_niov - 1].iov_base +
+		    tx_iov[tx_niov - 1].iov_len == (char *)buf) {
+			tx_iov[tx_niov - 1].iov_len += len;
+			tx_bytes += len;
+			return;
 		}
 	}
-	fprintf(stderr, "%s: cannot find arduino\n", myname);
-	exit(1);
+	tx_iov[tx_niov].iov_base = buf;
+	tx_iov[tx_niov].iov_len = len;
+	tx_niov++;
+	tx_bytes += len;
+}
+
+static void
+arduino_write(void *buf, int len)
+{
+	tx_add(buf, len, 1);
 }
 
 /*
- * Tell the arduino to do something to the PIC
+ * Forget whatever the arduino has sent so far.
  */
+static void
+rx_discard()
+{
+	tcflush(fd, TCIFLUSH);
+	rx_head = rx_tail = 0;
+}
 
-#define	NO_DATA		0
-#define	SEND_DATA	1
-#define	READ_DATA	2
-
+/*
+ * Wait until deadline for more bytes from the arduino, sending ours
+ * first.  Returns the number read, or an IO_ error.
+ */
 static int
-send_command(int command, int data)
+rx_fill(long deadline)
 {
-	int type;
-	int len;
+	struct pollfd p;
+	unsigned int space;
+	long left;
 	int r;
-	int c;
-	int rdata;
-	unsigned char lbuf[128];
 
-	switch(command) {
-	    case LoadConfiguration:
-	    case LoadDataforProgramMemory:
-	    case LoadDataforDataMemory:
-	    	type = SEND_DATA;
-		if (verbose)
-			printf("Sending command %d with data %x\n",
-				command, data);
-		break;
-	    case ReadDatafromProgramMemory:
-	    case ReadDatafromDataMemory:
-	    	type = READ_DATA;
-		if (verbose)
-			printf("Sending command %d.  Expecting data.\n",
-				command);
-		break;
-	    case IncrementAddress:
-	    case ResetAddress:
-	    case BeginProgramming:
-	    case BulkEraseProgramMemory:
-	    case BulkEraseDataMemory:
-	    	type = NO_DATA;
-		if (verbose)
-			printf("Sending command %d.\n", command);
-		break;
-	    default:
-	    	fprintf(stderr, "%s: send command unknown %d\n",
-			myname, command);
-		exit(1);
+	tx_flush();
+	left = deadline - now_ms();
+	if (left < 0)
+		left = 0;
+	p.fd = fd;
+	p.events = POLLIN;
+	io_polls++;
+	r = poll(&p, 1, left);
+	if (r == 0) {
+		io_error.error = IO_TIMEOUT;
+		io_error.ms = left;
+		return IO_TIMEOUT;
 	}
-
-	lbuf[0] = command + 'a';
-	len = 1;
-	if (type == SEND_DATA) {
-		sprintf(lbuf + 1, "%04x", data);
-		len = 5;
+	if (r < 0) {
+		io_error.error = IO_ERROR;
+		io_error.err = errno;
+		return IO_ERROR;
 	}
-	r = write(fd, lbuf, len);
 
-	if (r != len) {
-		fprintf(stderr, "%s send command write failed %d\n",
-			myname, r);
-		perror("write");
-		exit(1);
+	/* Read as much as fits without wrapping. */
+	space = RX_SIZE - (rx_head - rx_tail);
+	if (space > RX_SIZE - (rx_head & (RX_SIZE - 1)))
+		space = RX_SIZE - (rx_head & (RX_SIZE - 1));
+	r = read(fd, rx_buf + (rx_head & (RX_SIZE - 1)), space);
+	io_reads++;
+	if (r == 0) {
+		io_error.error = IO_CLOSED;
+		return IO_CLOSED;
 	}
-
-	/*
-	 * Read the return;
-	 */
-	rdata = 0;
-	if (type == READ_DATA) {
-		lbuf[0] = arduino_read();
-		lbuf[1] = arduino_read();
-		lbuf[2] = arduino_read();
-		lbuf[3] = arduino_read();
-		lbuf[4] = '\0';
-
-		r = sscanf(lbuf, "%04x", &rdata);
-		if (r != 1) {
-			fprintf(stderr, "%s: scanf returned %d from: .%s.\n",
-				myname, r, lbuf);
-			exit(1);
-		}
-
-		if (verbose)
-			printf("\tReturning data %04x\n", rdata);
+	if (r < 0) {
+		io_error.error = IO_ERROR;
+		io_error.err = errno;
+		return IO_ERROR;
 	}
+	rx_head += r;
+	return r;
+}
 
-	c = arduino_read();
+/*
+ * Read one byte from the arduino, whatever it is, if it comes by
+ * deadline.  Otherwise returns an IO_ error.
+ */
+static int
+arduino_getc_deadline(long deadline)
+{
+	int r;
 
-	if (c != '!') {
-		fprintf(stderr, "%s: expected \'!\', got: .%c.\n",
-			myname, c);
-		exit(1);
-	}
-	return rdata;
+	while (rx_head == rx_tail)
+		if ((r = rx_fill(deadline)) < 0)
+			return r;
+	return rx_buf[rx_tail++ & (RX_SIZE - 1)];
 }
 
 /*
- * This routine can print program or config space.
+ * Same, but give up after ms milliseconds.  Returns -1 if nothing came.
  */
-static void
-do_print1()
+static int
+arduino_getc_timeout(int ms)
 {
-	int i;
-	int data;
-
-	if (print & PRINT_CONFIG) {
-		send_command(LoadConfiguration, 0);
-		printf("\nPrinting Configuration Registers\n");
-	} else {
-		printf("\nPrinting first 11 words of program memmory.\n");
-		send_command(ResetAddress, 0);
-	}
+	int c;
 
-	for (i = 0; i < 11; i++) {
-		data = send_command(ReadDatafromProgramMemory, 0);
-		send_command(IncrementAddress, 0);
-		printf("\t%04x  %04x\n", i, data);
-	}
+	if (rx_head != rx_tail)
+		return rx_buf[rx_tail++ & (RX_SIZE - 1)];
+	c = arduino_getc_deadline(now_ms() + ms);
+	return c < 0 ? -1 : c;
 }
 
 /*
- * This routine can print data space
+ * Read one byte from the arduino, whatever it is.
  */
-static void
-do_print2()
+static int
+arduino_getc()
 {
-	int i;
-	int data;
+	int c;
 
-	printf("\nPrinting first 10 words of Data Memory\n");
-	send_command(ResetAddress, 0);
-	for (i = 0; i < 10; i++) {
-		data = send_command(ReadDatafromDataMemory, 0);
-		send_command(IncrementAddress, 0);
-		data &= 0xff;
-		printf("\t  %02x    %02x\n", i, data);
-	}
+	c = arduino_getc_deadline(now_ms() + REPLY_TIMEOUT);
+	if (c < 0)
+		io_fail("reading a reply");
+	return c;
 }
 
-/* The next word we receive goes here. */
-int pic_address;
+static int
+arduino_read()
+{
+	int c;
 
-/* number of words in the programming latches. */
-int data_in_latches;
+	do
+		c = arduino_getc();
+	while (IS_BLANK(c));
+	return c;
+}
 
-static void
-flush_latches()
+/*
+ * arduino_read, but give up after ms milliseconds of silence.
+ */
+static int
+arduino_read_timeout(int ms)
 {
-	if (!verify && data_in_latches > 0)
-		send_command(BeginProgramming, 0);
-	data_in_latches = 0;
+	int c;
+
+	do
+		c = arduino_getc_timeout(ms);
+	while (IS_BLANK(c));
+	return c;
 }
 
+char port_path[128];	/* the port we opened */
+int baud_rate;		/* the port is set to this */
+int max_baud;		/* fastest rate to try */
+int baud_given;		/* max_baud came from the command line */
+int no_reset;		/* don't reset the arduino when opening the port */
 
 /*
- * Start programming the PIC.
+ * Rates we can ask the arduino for, fastest first.  Some systems
+ * don't have all of them.
+ */
+static struct {
+	int rate;
+	speed_t code;
+} speeds[] = {
+#ifdef B2000000
+	{ 2000000, B2000000 },
+#endif
+#ifdef B1000000
+	{ 1000000, B1000000 },
+#endif
+#ifdef B500000
+	{ 500000, B500000 },
+#endif
+#ifdef B250000
+	{ 250000, B250000 },
+#endif
+	{ 115200, B115200 },
+	{ 9600, B9600 },
+};
+#define	NSPEEDS	(sizeof speeds / sizeof speeds[0])
+
+static int
+speed_index(int rate)
+{
+	int i;
+
+	for (i = 0; i < NSPEEDS; i++)
+		if (speeds[i].rate == rate)
+			return i;
+	return -1;
+}
+
+/*
+ * Returns -1 if the port won't take it, e.g. it isn't really a serial
+ * port.
+ */
+static int
+set_speed(int rate)
+{
+	speed_t code;
+	struct termios tdata;
+
+	/* What we have said so far goes at the old rate. */
+	tx_flush();
+	tcdrain(fd);
+
+	if (tcgetattr(fd, &tdata) != 0)
+		return -1;
+
+	code = speeds[speed_index(rate)].code;
+	if (verbose) {
+		printf("Setting baud rate to %d\n", rate);
+		printf("B%d = %d, Speed = %d\n", rate, code,
+			cfgetispeed(&tdata));
+	}
+
+	if (cfsetispeed(&tdata, code) != 0 || cfsetospeed(&tdata, code) != 0)
+		return -1;
+
+	/* Binary frames must get through untouched. */
+	cfmakeraw(&tdata);
+
+	if (tcsetattr(fd, TCSANOW, &tdata) != 0)
+		return -1;
+	baud_rate = rate;
+	return 0;
+}
+
+/*
+ * Change speed on the port we are using, which has to work.
+ */
+static void
+need_speed(int rate)
+{
+	if (set_speed(rate) < 0) {
+		fprintf(stderr, "%s: can't set %s to %d baud: %s\n",
+			myname, port_path, rate, strerror(errno));
+		exit(1);
+	}
+}
+
+/*
+ * Things learned about a port are kept in ~/.picloader, one per line:
+ * what it is, the port, and the value.  Losing the file costs nothing
+ * but time.
+ */
+#define	CACHE_LINES	64
+
+static char *
+cache_file()
+{
+	static char path[256];
+	char *home;
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return NULL;
+	snprintf(path, sizeof path, "%s/.picloader", home);
+	return path;
+}
+
+static int
+cache_get(char *key, char *name, char *value, int size)
+{
+	FILE *f;
+	char *path;
+	char lbuf[256];
+	char k[32], n[128], v[128];
+	int found;
+
+	path = cache_file();
+	if (path == NULL || (f = fopen(path, "r")) == NULL)
+		return 0;
+	flock(fileno(f), LOCK_SH);
+	found = 0;
+	while (fgets(lbuf, sizeof lbuf, f) != NULL) {
+		if (sscanf(lbuf, "%31s %127s %127s", k, n, v) != 3)
+			continue;
+		if (strcmp(k, key) == 0 && strcmp(n, name) == 0) {
+			snprintf(value, size, "%s", v);
+			found = 1;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+static void
+cache_put(char *key, char *name, char *value)
+{
+	FILE *f;
+	char *path;
+	char lines[CACHE_LINES][256];
+	char k[32], n[128];
+	int nlines;
+	int lock;
+	int i;
+
+	/* Loaders in gang mode share the file. */
+	path = cache_file();
+	if (path == NULL || (lock = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+		return;
+	flock(lock, LOCK_EX);
+	nlines = 0;
+	if ((f = fopen(path, "r")) != NULL) {
+		while (nlines < CACHE_LINES - 1 &&
+		    fgets(lines[nlines], sizeof lines[0], f) != NULL) {
+			if (sscanf(lines[nlines], "%31s %127s", k, n) == 2 &&
+			    strcmp(k, key) == 0 && strcmp(n, name) == 0)
+				continue;
+			nlines++;
+		}
+		fclose(f);
+	}
+	snprintf(lines[nlines++], sizeof lines[0], "%s %s %s\n",
+		key, name, value);
+
+	if ((f = fopen(path, "w")) != NULL) {
+		for (i = 0; i < nlines; i++)
+			fputs(lines[i], f);
+		fclose(f);
+	}
+	close(lock);
+}
+
+/*
+ * How far a load of the image hashing to resume_hash has got on this
+ * port is kept in the cache as "resume", and written again every
+ * JOURNAL_WORDS words, so that even a load that is killed can be
+ * carried on.  See load_image().
+ */
+#define	JOURNAL_WORDS	128
+
+unsigned long long resume_hash;
+int journal_on;
+int journaled;			/* where the cache has it */
+
+/*
+ * Note that program memory below a is written, or with a -1 that
+ * there is nothing to carry on.
+ */
+static void
+journal(int a)
+{
+	char value[64];
+
+	if (a < 0)
+		strcpy(value, "-");
+	else
+		snprintf(value, sizeof value, "%016llx/%04x", resume_hash, a);
+	cache_put("resume", port_path, value);
+	journaled = a;
+}
+
+/*
+ * Read the rest of a line from the arduino, dropping white space.
+ */
+static void
+arduino_read_line(char *buf, int size)
+{
+	char c;
+	int n;
+
+	n = 0;
+	for (;;) {
+		c = arduino_getc();
+		if (c == '\n')
+			break;
+		if (IS_BLANK(c))
+			continue;
+		if (n < size - 1)
+			buf[n++] = c;
+	}
+	buf[n] = '\0';
+}
+
+/*
+ * Wait for the arduino to say it is out of reset, but no longer than
+ * READY_TIMEOUT.  Returns true if it did.
+ */
+static int
+wait_ready()
+{
+	char lbuf[64];
+	long deadline;
+	long left;
+	int n;
+	int c;
+
+	deadline = now_ms() + READY_TIMEOUT;
+	n = 0;
+	for (;;) {
+		left = deadline - now_ms();
+		if (left <= 0 || (c = arduino_getc_timeout(left)) < 0) {
+			if (verbose)
+				printf("No ready banner from the arduino\n");
+			return 0;
+		}
+		if (c == '\r')
+			continue;
+		if (c != '\n') {
+			if (n < sizeof lbuf - 1)
+				lbuf[n++] = c;
+			continue;
+		}
+		lbuf[n] = '\0';
+		n = 0;
+		if (strncmp(lbuf, READY_BANNER, strlen(READY_BANNER)) == 0) {
+			if (verbose)
+				printf("Arduino ready: \"%s\"\n", lbuf);
+			return 1;
+		}
+	}
+}
+
+/*
+ * The arduino is held in reset while DTR is down.
+ */
+#define	RESET_US	100000
+
+static void
+set_dtr(int tty, int on)
+{
+	int bits;
+
+	bits = TIOCM_DTR;
+	ioctl(tty, on ? TIOCMBIS : TIOCMBIC, &bits);
+}
+
+/*
+ * Reset the arduino by dropping DTR for a moment.
+ */
+static void
+reset_arduino()
+{
+	if (verbose)
+		printf("Resetting the arduino\n");
+	set_dtr(fd, 0);
+	usleep(RESET_US);
+	set_dtr(fd, 1);
+	rx_discard();
+}
+
+/*
+ * Numeric capabilities are an upper case letter followed by a
+ * decimal number.  Returns 0 if the arduino didn't send it.
+ */
+static int
+capability_value(int key)
+{
+	char *p;
+
+	p = strchr(capabilities, key);
+	if (p == NULL)
+		return 0;
+	return atoi(p + 1);
+}
+
+/*
+ * Get back in step after a failed speed change.  Both sides go back to
+ * the handshake rate; the arduino also does when it sees a command it
+ * doesn't expect, so "Z" gets it awaiting a handshake whichever rate
+ * it ended up at.
+ */
+static int
+resync()
+{
+	char lbuf[32];
+	int tries;
+
+	need_speed(BAUD);
+	for (tries = 0; tries < 3; tries++) {
+		usleep(2 * SPEED_TIMEOUT * 1000);
+		rx_discard();
+		arduino_write("ZA", 2);
+		if (arduino_read_timeout(SPEED_TIMEOUT) == 'B') {
+			arduino_read_line(lbuf, sizeof lbuf);
+			arduino_write("I", 1);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Ask the arduino to go to rate.  Returns true if we are both there
+ * and the test pattern got through both ways.  Otherwise we are both
+ * back at the handshake rate.
+ */
+static int
+try_speed(int rate)
+{
+	char lbuf[16];
+	int c;
+	int i;
+
+	if (verbose)
+		printf("Trying %d baud\n", rate);
+
+	sprintf(lbuf, "S%08x", rate);
+	arduino_write(lbuf, 9);
+	c = arduino_read_timeout(SPEED_TIMEOUT);
+	if (c == 'N') {
+		arduino_read_line(lbuf, sizeof lbuf);
+		return 0;
+	}
+	if (c != 'S')
+		goto fail;
+	arduino_read_line(lbuf, sizeof lbuf);
+
+	need_speed(rate);
+	usleep(10000);		/* let the arduino switch too */
+	arduino_write(speed_pattern, sizeof speed_pattern);
+	for (i = 0; i < sizeof speed_pattern; i++)
+		if (arduino_getc_timeout(SPEED_TIMEOUT) != speed_pattern[i])
+			goto fail;
+	arduino_write("K", 1);
+	if (arduino_read_timeout(SPEED_TIMEOUT) != 'K')
+		goto fail;
+	arduino_read_line(lbuf, sizeof lbuf);
+	return 1;
+
+    fail:
+	if (!resync()) {
+		fprintf(stderr, "%s: lost the arduino trying %d baud\n",
+			myname, rate);
+		exit(1);
+	}
+	return 0;
+}
+
+/*
+ * Move to the fastest rate that works, starting with the one that
+ * worked on this port last time.
+ */
+static void
+negotiate_speed()
+{
+	char lbuf[32];
+	int cached;
+	int i;
+
+	if (capability_value('S') != 1 || max_baud <= BAUD)
+		return;
+
+	cached = 0;
+	if (!baud_given && cache_get("baud", port_path, lbuf, sizeof lbuf))
+		cached = atoi(lbuf);
+	if (speed_index(cached) >= 0 && cached <= max_baud &&
+	    try_speed(cached))
+		goto done;
+
+	for (i = 0; i < NSPEEDS; i++) {
+		if (speeds[i].rate > max_baud || speeds[i].rate == cached)
+			continue;
+		if (speeds[i].rate == BAUD || try_speed(speeds[i].rate))
+			break;
+	}
+
+    done:
+	if (verbose)
+		printf("Talking to the arduino at %d baud\n", baud_rate);
+	/* Falling back may have been bad luck, so try again next time */
+	if (baud_rate == BAUD)
+		strcpy(lbuf, "-");
+	else
+		sprintf(lbuf, "%d", baud_rate);
+	cache_put("baud", port_path, lbuf);
+}
+
+/*
+ * The arduino has answered "B" and we have its capabilities.  Finish
+ * the handshake and get the link up to speed.
+ */
+static void
+connected()
+{
+	int c;
+
+	arduino_write("I", 1);
+
+	window = capability_value('W');
+	if (window == 0)
+		stop_and_wait = 1;
+
+	targets = capability_value('T');
+	if (targets < 1 || targets > MAX_TARGETS)
+		targets = 1;
+	live = (1 << targets) - 1;
+
+	if (verbose)
+		printf("Handshake complete, capabilities \"%s\"\n",
+			capabilities);
+
+	negotiate_speed();
+
+	/*
+	 * Switch to binary frames if the arduino has them.
+	 */
+	framed = 0;
+	if (!ascii_only && capability_value('F') == 1) {
+		arduino_write("F", 1);
+		c = arduino_read();
+		if (c != 'F') {
+			fprintf(stderr, "%s: arduino refused binary frames\n",
+				myname);
+			exit(1);
+		}
+		framed = 1;
+		tx_seq = 0;		/* the arduino starts counting again */
+		if (verbose)
+			printf("Using binary frames\n");
+	}
+}
+
+/*
+ * returns true if it is able to handshake with the arduino.
+ * The "B" reply is followed by the arduino's capability string.
+ */
+static int
+handshake()
+{
+	int c;
+
+	/* "Z" first, in case an earlier session left it connected. */
+	arduino_write("ZA", 2);
+	c = arduino_read_timeout(SPEED_TIMEOUT);
+	if (c != 'B' && no_reset) {
+		/*
+		 * Whatever the last session left it doing, it isn't
+		 * listening.  Reset it after all.
+		 */
+		reset_arduino();
+		wait_ready();
+		arduino_write("A", 1);
+		c = arduino_read_timeout(SPEED_TIMEOUT);
+	}
+
+	if (c != 'B')
+		return 0;
+	arduino_read_line(capabilities, sizeof capabilities);
+	connected();
+	return 1;
+}
+
+/*
+ * returns true if the arduino implements the command.
+ * Command letters are lower case.
+ */
+static int
+has_command(int command)
+{
+	return strchr(capabilities, command + 'a') != NULL;
+}
+
+static char *
+gen_name(char *name)
+{
+	static char lbuf[128];
+
+	sprintf(lbuf, "%s%s", portbasename, name);
+	return lbuf;
+}
+
+/*
+ * Get the port ready to talk to the arduino.  Returns -1 if it can't
+ * be set up, 1 if the arduino is coming out of reset and 0 if it is
+ * still up.  *reset is set if it still wants reset_arduino(), which is
+ * left to the caller so that discover() can reset every port at once.
+ */
+static int
+setup_port(int *reset)
+{
+	struct termios tdata;
+	int was_reset;
+
+	/*
+	 * Opening the port resets the arduino if closing it last time
+	 * dropped DTR, which is what HUPCL does.  With no_reset we clear
+	 * it, so the arduino stays up between runs.
+	 */
+	if (tcgetattr(fd, &tdata) == 0) {
+		was_reset = (tdata.c_cflag & HUPCL) != 0;
+		if (no_reset)
+			tdata.c_cflag &= ~HUPCL;
+		else
+			tdata.c_cflag |= HUPCL;
+		tcsetattr(fd, TCSANOW, &tdata);
+	} else
+		was_reset = 1;
+
+	if (set_speed(BAUD) < 0)
+		return -1;
+
+	/* Anything still buffered from an earlier session is stale. */
+	rx_discard();
+
+	*reset = 0;
+	if (no_reset && !was_reset)
+		return 0;
+	*reset = !was_reset;
+	return 1;
+}
+
+static void
+set_baud()
+{
+	int reset;
+	int r;
+
+	r = setup_port(&reset);
+	if (r < 0) {
+		fprintf(stderr, "%s: can't set up %s: %s\n", myname,
+			port_path, strerror(errno));
+		exit(1);
+	}
+	if (reset)
+		reset_arduino();
+	if (r)
+		wait_ready();
+}
+
+void
+l_opentty(char *name)
+{
+	fd = open(name, O_RDWR);
+	if (fd < 0)
+		return;
+	snprintf(port_path, sizeof port_path, "%s", name);
+
+	if (!isatty(fd)) {
+/*xxx*/printf("not a tty\n");
+		close(fd);
+		return;
+	}
+	set_baud();
+}
+
+/*
+ * Look for the arduino on every likely port at once.  Each port gets
+ * "ZA" straight away, for an arduino that wasn't reset, and "A" again
+ * when its ready banner arrives or READY_TIMEOUT passes.  The first
+ * port to answer "B" wins.
+ */
+#define	MAX_PROBES	64
+
+struct probe {
+	int fd;
+	char name[128];
+	long deadline;
+	int reset;		/* wants DTR dropped */
+	int prodded;		/* sent the second "A" */
+	int n;
+	char line[64];
+};
+
+static int
+discover()
+{
+	struct probe probes[MAX_PROBES];
+	struct pollfd pfd[MAX_PROBES];
+	struct probe *p;
+	glob_t g;
+	char lbuf[16];
+	char buf[64];
+	long now;
+	long wait;
+	int nprobes;
+	int resets;
+	int npoll;
+	int i, j, r;
+
+	memset(&g, 0, sizeof g);
+	glob("/dev/ttyUSB*", 0, NULL, &g);
+	glob("/dev/ttyACM*", GLOB_APPEND, NULL, &g);
+
+	nprobes = 0;
+	for (i = 0; i < 32 + (int)g.gl_pathc && nprobes < MAX_PROBES; i++) {
+		p = &probes[nprobes];
+		if (i < 32) {
+			sprintf(lbuf, "%d", i);
+			snprintf(p->name, sizeof p->name, "%s", gen_name(lbuf));
+		} else
+			snprintf(p->name, sizeof p->name, "%s",
+				g.gl_pathv[i - 32]);
+
+		p->fd = open(p->name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (p->fd < 0)
+			continue;
+		if (!isatty(p->fd)) {
+			close(p->fd);
+			continue;
+		}
+		fd = p->fd;
+		if (setup_port(&p->reset) < 0) {
+			close(p->fd);
+			continue;
+		}
+		if (verbose)
+			printf("Probing %s\n", p->name);
+		nprobes++;
+	}
+	globfree(&g);
+
+	/* Hold all the ones that want it in reset together */
+	resets = 0;
+	for (i = 0; i < nprobes; i++)
+		if (probes[i].reset) {
+			set_dtr(probes[i].fd, 0);
+			resets++;
+		}
+	if (resets) {
+		usleep(RESET_US);
+		for (i = 0; i < nprobes; i++)
+			if (probes[i].reset) {
+				set_dtr(probes[i].fd, 1);
+				tcflush(probes[i].fd, TCIFLUSH);
+			}
+	}
+	for (i = 0; i < nprobes; i++) {
+		p = &probes[i];
+		write(p->fd, "ZA", 2);
+		p->deadline = now_ms() + READY_TIMEOUT;
+		p->prodded = 0;
+		p->n = 0;
+	}
+
+	for (;;) {
+		npoll = 0;
+		wait = READY_TIMEOUT;
+		now = now_ms();
+		for (i = 0; i < nprobes; i++) {
+			p = &probes[i];
+			if (p->fd < 0)
+				continue;
+			if (now >= p->deadline) {
+				if (p->prodded) {
+					close(p->fd);
+					p->fd = -1;
+					continue;
+				}
+				write(p->fd, "A", 1);
+				p->prodded = 1;
+				p->deadline = now + SPEED_TIMEOUT;
+			}
+			if (p->deadline - now < wait)
+				wait = p->deadline - now;
+			pfd[npoll].fd = p->fd;
+			pfd[npoll].events = POLLIN;
+			npoll++;
+		}
+		if (npoll == 0)
+			return 0;
+
+		if (poll(pfd, npoll, wait) < 1)
+			continue;
+
+		for (i = 0; i < nprobes; i++) {
+			p = &probes[i];
+			if (p->fd < 0)
+				continue;
+			for (j = 0; j < npoll; j++)
+				if (pfd[j].fd == p->fd)
+					break;
+			if (j == npoll || !(pfd[j].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			r = read(p->fd, buf, sizeof buf);
+			if (r <= 0) {
+				close(p->fd);
+				p->fd = -1;
+				continue;
+			}
+			for (j = 0; j < r; j++) {
+				if (buf[j] == '\r' || buf[j] == ' ')
+					continue;
+				if (buf[j] != '\n') {
+					if (p->n < sizeof p->line - 1)
+						p->line[p->n++] = buf[j];
+					continue;
+				}
+				p->line[p->n] = '\0';
+				p->n = 0;
+				if (p->line[0] == 'B')
+					goto found;
+				if (strncmp(p->line, READY_BANNER,
+				    strlen(READY_BANNER)) == 0 && !p->prodded) {
+					write(p->fd, "A", 1);
+					p->prodded = 1;
+					p->deadline = now_ms() + SPEED_TIMEOUT;
+				}
+			}
+		}
+	}
+
+    found:
+	for (j = 0; j < nprobes; j++)
+		if (j != i && probes[j].fd >= 0)
+			close(probes[j].fd);
+	fd = p->fd;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	snprintf(port_path, sizeof port_path, "%s", p->name);
+	snprintf(capabilities, sizeof capabilities, "%s", p->line + 1);
+	if (verbose)
+		printf("Found the arduino on %s\n", port_path);
+	connected();
+	return 1;
+}
+
+void
+openport(char *portname)
+{
+	char lbuf[128];
+
+	if (portname) {
+		l_opentty(portname);
+		if (fd > 0) {
+			if (handshake())
+				return;
+			close(fd);
+		}
+		l_opentty(gen_name(portname));
+		if (fd > 0) {
+			if (handshake())
+				return;
+			close(fd);
+		}
+		fprintf(stderr, "%s: cannot open port %s or %s\n",
+			myname,
+			portname,
+			gen_name(portname));
+		exit(1);
+	}
+
+	/*
+	 * Try where we found it last time, then look everywhere.
+	 */
+	if (cache_get("port", "default", lbuf, sizeof lbuf)) {
+		l_opentty(lbuf);
+		if (fd > 0) {
+			if (handshake())
+				return;
+			close(fd);
+		}
+	}
+	if (discover()) {
+		cache_put("port", "default", port_path);
+		return;
+	}
+	fprintf(stderr, "%s: cannot find arduino\n", myname);
+	exit(1);
+}
+
+/*
+ * Tell the arduino to do something to the PIC
+ *
+ * Commands are pipelined.  The arduino advertises how many bytes its
+ * serial receive buffer can hold, and we keep sending until the
+ * commands not yet acknowledged would fill it.  The acknowledgements
+ * (and any read data) come back in the order the commands were sent.
+ * If the arduino gives no window we wait for each command in turn.
+ *
+ * In binary frames, a damaged frame from us is NAKed and we resend
+ * it and everything after it.  If one of the arduino's replies is
+ * damaged we ask it which frame it wants next, to learn what ran.
+ */
+
+#define	NO_DATA		0
+#define	SEND_DATA	1
+#define	READ_DATA	2
+#define	CONTROL		3	/* reply is a single status letter */
+#define	NO_REPLY	4
+
+#define	MAX_PENDING	128
+#define	MAX_RETRIES	10
+#define	FRAME_TIMEOUT	500	/* ms to wait for a reply frame */
+#define	BACKOFF_MS	10	/* pause before a second resend, doubling */
+
+/*
+ * A command being built.  Parameters are hex digits, or raw bytes
+ * in a frame.
+ */
+struct msg {
+	int len;
+	unsigned char buf[8 + 4 * PIC_NUMBER_OF_LATCHES];
+};
+
+#define	MAX_READ	32	/* most words one Read Words brings back */
+
+struct pending {
+	int type;
+	int len;		/* bytes on the wire */
+	int seq;		/* frame sequence number */
+	int nwords;		/* words of read data */
+	int *dest;		/* where to put them */
+	int check;		/* compare read data against expect */
+	int loaded;		/* program memory below is written once done */
+	int expect[MAX_READ];
+	int lineno[MAX_READ];
+	unsigned char frame[FRAME_MAX + 5];	/* kept for resending */
+};
+
+struct pending pending[MAX_PENDING];
+int pending_first;		/* oldest unacknowledged command */
+int pending_count;
+int pending_bytes;
+int retries;			/* resends since the last good reply */
+int last_rdata;			/* data returned by the last read */
+int rwords[MAX_READ * MAX_TARGETS];	/* of the reply being finished */
+int last_status;		/* reply to the last control command */
+int loaded;			/* program memory below this is written */
+int step_loaded;		/* for the next command issued */
+
+static void
+msg_start(struct msg *m, int letter)
+{
+	m->buf[0] = letter;
+	m->len = 1;
+}
+
+static void
+msg_byte(struct msg *m, int v)
+{
+	if (framed)
+		m->buf[m->len++] = v;
+	else
+		m->len += sprintf((char *)m->buf + m->len, "%02x", v & 0xff);
+}
+
+static void
+msg_word(struct msg *m, int v)
+{
+	if (framed) {
+		m->buf[m->len++] = v & 0xff;
+		m->buf[m->len++] = (v >> 8) & 0xff;
+	} else
+		m->len += sprintf((char *)m->buf + m->len, "%04x", v);
+}
+
+/*
+ * Wrap a payload in a frame.  Returns the frame length.
+ */
+static int
+frame_wrap(unsigned char *f, int seq, unsigned char *payload, int len)
+{
+	int i;
+	unsigned short crc;
+
+	f[0] = FRAME_SYNC;
+	f[1] = len;
+	f[2] = seq;
+	memcpy(f + 3, payload, len);
+	crc = 0xffff;
+	for (i = 1; i < len + 3; i++)
+		crc = crc16_update(crc, f[i]);
+	f[len + 3] = crc & 0xff;
+	f[len + 4] = crc >> 8;
+	return len + 5;
+}
+
+struct reply {
+	int len;
+	int seq;
+	unsigned char data[256];
+};
+
+/*
+ * Read a frame from the arduino.  Returns 0 if it was damaged or
+ * didn't come.
+ */
+static int
+read_frame(struct reply *f)
+{
+	int i;
+	int c;
+	int lo;
+	int hi;
+	long deadline;
+	unsigned short crc;
+
+	deadline = now_ms() + FRAME_TIMEOUT;
+	do {
+		c = arduino_getc_deadline(deadline);
+		if (c < 0)
+			return 0;
+	} while (c != FRAME_SYNC);
+
+	crc = 0xffff;
+	f->len = arduino_getc_deadline(deadline);
+	if (f->len < 1)
+		return 0;
+	crc = crc16_update(crc, f->len);
+	f->seq = arduino_getc_deadline(deadline);
+	crc = crc16_update(crc, f->seq);
+	for (i = 0; i < f->len; i++) {
+		c = arduino_getc_deadline(deadline);
+		if (c < 0)
+			return 0;
+		f->data[i] = c;
+		crc = crc16_update(crc, c);
+	}
+	lo = arduino_getc_deadline(deadline);
+	hi = arduino_getc_deadline(deadline);
+
+	return f->seq >= 0 && lo == (crc & 0xff) && hi == (crc >> 8);
+}
+
+/*
+ * "target N: " for messages about one of several targets.
+ */
+static char *
+target_name(int t)
+{
+	static char buf[sizeof "target -2147483648: "];
+
+	if (targets == 1)
+		return "";
+	snprintf(buf, sizeof buf, "target %d: ", t);
+	return buf;
+}
+
+/*
+ * Give up on target t.  It still gets the writes, but nothing it
+ * sends back is looked at.  Once none are left, give up altogether.
+ */
+static void
+fail_target(int t)
+{
+	live &= ~(1 << t);
+	if (live == 0)
+		exit(1);
+}
+
+/*
+ * The oldest outstanding command has completed.  Read data has a
+ * word from each target for each word read, and goes to dest that
+ * way.
+ */
+static void
+finish_command(int status, int rdata)
+{
+	int i;
+	int t;
+	int w;
+	struct pending *p;
+
+	p = &pending[pending_first];
+	pending_first = (pending_first + 1) % MAX_PENDING;
+	pending_count--;
+	pending_bytes -= p->len;
+	retries = 0;
+
+	if (p->type == CONTROL) {
+		last_status = status;
+		return;
+	}
+
+	if (status != '!') {
+		fprintf(stderr, "%s: expected \'!\', got: .%c.\n",
+			myname, status);
+		link_fail();
+	}
+	if (p->loaded > loaded) {
+		loaded = p->loaded;
+		if (journal_on && loaded - journaled >= JOURNAL_WORDS)
+			journal(loaded);
+	}
+
+	if (p->type == READ_DATA) {
+		if (verbose && p->nwords == 1)
+			printf("\tReturning data %04x\n", rdata);
+		else if (verbose)
+			printf("\tReturning %d words\n", p->nwords);
+		last_rdata = rdata;
+	}
+
+	for (i = 0; i < p->nwords * targets; i++) {
+		w = rwords[i];
+		t = i % targets;
+		if (p->dest)
+			p->dest[i] = w;
+		if (p->check && (live & 1 << t) &&
+		    w != p->expect[i / targets]) {
+			fprintf(stderr, "%s: %sverify error on line %d\n",
+				myname, target_name(t),
+				p->lineno[i / targets]);
+			if (verbose) {
+				fprintf(stderr, "\tExpected %x ",
+					p->expect[i / targets]);
+				fprintf(stderr, "\t-- Got %x ", w);
+			}
+			fail_target(t);
+		}
+	}
+}
+
+/*
+ * Count another try at getting frames through, and give up on the
+ * link after too many.  After the first, wait a little longer each
+ * time, so a burst of noise can pass.
+ */
+static void
+backoff()
+{
+	int ms;
+
+	if (++retries > MAX_RETRIES) {
+		fprintf(stderr, "%s: too many damaged frames\n", myname);
+		link_fail();
+	}
+	if (retries == 1)
+		return;
+	ms = BACKOFF_MS << (retries - 2);
+	if (ms > FRAME_TIMEOUT)
+		ms = FRAME_TIMEOUT;
+	tx_flush();
+	poll(NULL, 0, ms);
+}
+
+/*
+ * Resend every outstanding frame.
+ */
+static void
+resend_frames()
+{
+	int i;
+	struct pending *p;
+
+	backoff();
+	if (verbose)
+		printf("Resending %d frames\n", pending_count);
+
+	for (i = 0; i < pending_count; i++) {
+		p = &pending[(pending_first + i) % MAX_PENDING];
+		tx_add(p->frame, p->len, 0);
+	}
+}
+
+/*
+ * The arduino wants frame seq next, so everything before it has run.
+ * Finish those commands, then resend the rest.  Returns 0 if one of
+ * them still needs its reply.
+ */
+static int
+resume_from(int seq)
+{
+	struct pending *p;
+
+	while (pending_count > 0) {
+		p = &pending[pending_first];
+		if (p->seq == seq)
+			break;
+		if (((seq - p->seq) & 0xff) > 128) {
+			fprintf(stderr, "%s: arduino lost its place\n",
+				myname);
+			link_fail();
+		}
+		if (p->nwords > 0 || p->type == CONTROL)
+			return 0;
+		finish_command('!', 0);
+	}
+	if (pending_count > 0)
+		resend_frames();
+	return 1;
+}
+
+/*
+ * A good reply to one of our frames.  The frames before it have run,
+ * and those with nothing to return are finished.  Returns 0 if the
+ * reply can't be used because an earlier command's data is missing.
+ * Replies to frames already finished are ignored.
+ */
+static int
+take_reply(struct reply *f)
+{
+	int i;
+	int n;
+	struct pending *p;
+
+	for (n = 0; n < pending_count; n++) {
+		p = &pending[(pending_first + n) % MAX_PENDING];
+		if (p->seq == f->seq)
+			break;
+		if (p->nwords > 0 || p->type == CONTROL)
+			return 0;
+	}
+	if (n == pending_count)
+		return 1;
+
+	for (i = 0; i < n; i++)
+		finish_command('!', 0);
+	if (f->data[0] == '!' && f->len < 1 + 2 * p->nwords * targets) {
+		fprintf(stderr, "%s: short reply from arduino\n", myname);
+		link_fail();
+	}
+	for (i = 0; i < p->nwords * targets && 2 + 2 * i < f->len; i++)
+		rwords[i] = f->data[1 + 2 * i] | (f->data[2 + 2 * i] << 8);
+	finish_command(f->data[0], rwords[0]);
+	return 1;
+}
+
+/*
+ * One of the arduino's replies was damaged or never came, so we don't
+ * know which of our frames have run.  Have it send its replies again
+ * from our oldest outstanding frame, followed by the sequence number
+ * it wants next.
+ */
+static void
+recover_frames()
+{
+	int n;
+	int tag;
+	struct reply f;
+	unsigned char q[8];
+
+	tag = 0;
+	for (;;) {
+		backoff();
+		if (verbose)
+			printf("Damaged reply, asking arduino for status\n");
+
+		f.data[0] = FRAME_STATUS;
+		f.data[1] = pending_count > 0 ?
+			pending[pending_first].seq : tx_seq;
+		f.data[2] = ++tag;
+		n = frame_wrap(q, 0, f.data, 3);
+		arduino_write(q, n);
+
+		while (read_frame(&f)) {
+			if (f.data[0] == FRAME_STATUS && f.len > 1 &&
+			    f.data[1] == tag) {
+				if (resume_from(f.seq))
+					return;
+				break;	/* some data still missing */
+			}
+			if (f.data[0] != FRAME_NAK &&
+			    f.data[0] != FRAME_STATUS)
+				take_reply(&f);
+		}
+	}
+}
+
+static void
+complete_frame()
+{
+	struct reply f;
+
+	if (!read_frame(&f)) {
+		recover_frames();
+		return;
+	}
+
+	if (f.data[0] == FRAME_NAK) {
+		if (verbose)
+			printf("NAK, arduino wants frame %d\n", f.seq);
+		if (!resume_from(f.seq))
+			recover_frames();
+		return;
+	}
+	if (f.data[0] == FRAME_STATUS)
+		return;		/* answer to an earlier status request */
+
+	if (!take_reply(&f))
+		recover_frames();
+}
+
+/*
+ * Wait for the oldest outstanding command to complete.
+ */
+static void
+complete_command()
+{
+	struct pending *p;
+	int i;
+	int r;
+	int rdata;
+	char lbuf[8];
+
+	if (framed) {
+		complete_frame();
+		return;
+	}
+
+	p = &pending[pending_first];
+	if (p->type == CONTROL) {
+		finish_command(arduino_read(), 0);
+		return;
+	}
+
+	/*
+	 * Read the return;
+	 */
+	rdata = 0;
+	for (i = 0; i < p->nwords * targets; i++) {
+		lbuf[0] = arduino_read();
+		lbuf[1] = arduino_read();
+		lbuf[2] = arduino_read();
+		lbuf[3] = arduino_read();
+		lbuf[4] = '\0';
+
+		r = sscanf(lbuf, "%04x", &rdata);
+		if (r != 1) {
+			fprintf(stderr, "%s: scanf returned %d from: .%s.\n",
+				myname, r, lbuf);
+			link_fail();
+		}
+		rwords[i] = rdata;
+	}
+
+	finish_command(arduino_read(), rwords[0]);
+}
+
+/*
+ * Wait for every outstanding command to complete.
+ */
+static void
+drain_commands()
+{
+	while (pending_count > 0)
+		complete_command();
+}
+
+/*
+ * Put a command on the wire once the arduino has room for it.
+ * A command bigger than the whole window is sent only when nothing
+ * else is outstanding; the arduino reads it as it executes.
+ */
+static struct pending *
+issue(struct msg *m, int type)
+{
+	struct pending *p;
+	unsigned char f[FRAME_MAX + 5];
+	int len;
+
+	len = m->len;
+	if (framed)
+		len += 5;
+
+	while (pending_count > 0 &&
+	    (pending_count >= MAX_PENDING || pending_bytes + len > window))
+		complete_command();
+
+	if (type == NO_REPLY) {
+		if (framed) {
+			frame_wrap(f, tx_seq, m->buf, m->len);
+			tx_seq = (tx_seq + 1) & 0xff;
+			arduino_write(f, len);
+		} else
+			arduino_write(m->buf, len);
+		tx_flush();
+		return NULL;
+	}
+
+	p = &pending[(pending_first + pending_count) % MAX_PENDING];
+	if (framed) {
+		frame_wrap(p->frame, tx_seq, m->buf, m->len);
+		p->seq = tx_seq;
+		tx_seq = (tx_seq + 1) & 0xff;
+		tx_add(p->frame, len, 0);
+	} else
+		arduino_write(m->buf, len);
+
+	pending_count++;
+	pending_bytes += len;
+	p->type = type;
+	p->len = len;
+	p->nwords = type == READ_DATA;
+	p->dest = NULL;
+	p->check = 0;
+	p->loaded = step_loaded;
+	step_loaded = 0;
+	return p;
+}
+
+static struct pending *
+start_command(int command, int data)
+{
+	int type;
+	struct msg m;
+
+	switch(command) {
+	    case LoadConfiguration:
+	    case LoadDataforProgramMemory:
+	    case LoadDataforDataMemory:
+	    	type = SEND_DATA;
+		if (verbose)
+			printf("Sending command %d with data %x\n",
+				command, data);
+		break;
+	    case ReadDatafromProgramMemory:
+	    case ReadDatafromDataMemory:
+	    	type = READ_DATA;
+		if (verbose)
+			printf("Sending command %d.  Expecting data.\n",
+				command);
+		break;
+	    case IncrementAddress:
+	    case ResetAddress:
+	    case BeginProgramming:
+	    case BulkEraseProgramMemory:
+	    case BulkEraseDataMemory:
+	    case RowEraseProgramMemory:
+	    	type = NO_DATA;
+		if (verbose)
+			printf("Sending command %d.\n", command);
+		break;
+	    default:
+	    	fprintf(stderr, "%s: send command unknown %d\n",
+			myname, command);
+		exit(1);
+	}
+
+	msg_start(&m, command + 'a');
+	if (type == SEND_DATA) {
+		msg_word(&m, data);
+		type = NO_DATA;
+	}
+	return issue(&m, type);
+}
+
+/*
+ * Send a command without waiting for it to complete.
+ */
+static void
+queue_command(int command, int data)
+{
+	start_command(command, data);
+	if (stop_and_wait)
+		drain_commands();
+}
+
+/*
+ * Send a read command.  The data is checked against expect when it
+ * comes back, and a mismatch is reported against lineno.
+ */
+static void
+queue_verify(int command, int expect, int lineno)
+{
+	struct pending *p;
+
+	p = start_command(command, 0);
+	p->check = 1;
+	p->expect[0] = expect;
+	p->lineno[0] = lineno;
+	if (stop_and_wait)
+		drain_commands();
+}
+
+/*
+ * Read n words, from program memory (memory 0) or data memory (1),
+ * leaving the address just past them.  The words are stored at dest
+ * if it isn't NULL.  If expect isn't NULL they are checked against it,
+ * and a mismatch is reported against the matching lineno.
+ */
+static void
+queue_read(int memory, int n, int *dest, int *expect, int *lineno)
+{
+	struct msg m;
+	struct pending *p;
+
+	if (verbose)
+		printf("Reading %d words\n", n);
+
+	msg_start(&m, ReadWords + 'a');
+	msg_byte(&m, memory);
+	msg_byte(&m, n);
+	p = issue(&m, READ_DATA);
+	p->nwords = n;
+	p->dest = dest;
+	if (expect) {
+		p->check = 1;
+		memcpy(p->expect, expect, n * sizeof expect[0]);
+		memcpy(p->lineno, lineno, n * sizeof lineno[0]);
+	}
+	if (stop_and_wait)
+		drain_commands();
+}
+
+/*
+ * Send a command and wait for it, and everything before it, to
+ * complete.  Returns the read data, if any.
+ */
+static int
+send_command(int command, int data)
+{
+	start_command(command, data);
+	drain_commands();
+	return last_rdata;
+}
+
+/*
+ * How many words one Read Words may bring back, 0 if the arduino
+ * doesn't have it.
+ */
+static int
+read_max()
+{
+	int n;
+
+	if (!has_command(ReadWords))
+		return 0;
+	n = capability_value('R');
+	return n > MAX_READ ? MAX_READ : n;
+}
+
+/*
+ * Read n words into buf, from the current address on.  With several
+ * targets, buf gets each word from each of them in turn.
+ */
+static void
+read_memory(int memory, int *buf, int n)
+{
+	int i;
+	int k;
+
+	if (read_max() == 0) {
+		for (i = 0; i < n; i++) {
+			send_command(memory ?
+				ReadDatafromDataMemory :
+				ReadDatafromProgramMemory, 0);
+			memcpy(buf + i * targets, rwords,
+				targets * sizeof buf[0]);
+			send_command(IncrementAddress, 0);
+		}
+		return;
+	}
+	for (i = 0; i < n; i += k) {
+		k = n - i < read_max() ? n - i : read_max();
+		queue_read(memory, k, buf + i * targets, NULL, NULL);
+	}
+	drain_commands();
+}
+
+/*
+ * Have the arduino read n words from the current address on and
+ * work out their CRC-32, leaving the address just past them.  The
+ * CRC comes back as two words at dest, low one first, from each
+ * target in turn; crc_of() puts them together.
+ */
+static void
+queue_crc(int memory, int n, int *dest)
+{
+	struct msg m;
+	struct pending *p;
+
+	if (verbose)
+		printf("CRC of %d words\n", n);
+
+	msg_start(&m, CRCWords + 'a');
+	msg_byte(&m, memory);
+	msg_word(&m, n);
+	p = issue(&m, READ_DATA);
+	p->nwords = 2;
+	p->dest = dest;
+	if (stop_and_wait)
+		drain_commands();
+}
+
+static unsigned long
+crc_of(int *words, int t)
+{
+	return words[t] | (unsigned long)words[targets + t] << 16;
+}
+
+/*
+ * The same, waiting for the CRC of each target.
+ */
+static void
+crc_memory(int memory, int n, unsigned long *crc)
+{
+	int words[2 * MAX_TARGETS];
+	int t;
+
+	queue_crc(memory, n, words);
+	drain_commands();
+	for (t = 0; t < targets; t++)
+		crc[t] = crc_of(words, t);
+}
+
+/*
+ * Send one of the single letter connection commands.  Returns the
+ * arduino's reply letter, or 0 for the ones that have no reply.
+ */
+static int
+send_control(int letter, int reply)
+{
+	struct msg m;
+
+	msg_start(&m, letter);
+	if (!reply) {
+		issue(&m, NO_REPLY);
+		return 0;
+	}
+	issue(&m, CONTROL);
+	drain_commands();
+	return last_status;
+}
+
+/*
+ * Load a row of words into the latches and program them.
+ * The arduino increments the address past each word.
+ */
+static void
+send_row(int *words, int n)
+{
+	int i;
+	struct msg m;
+
+	if (verbose)
+		printf("Sending row of %d words\n", n);
+
+	msg_start(&m, LoadRow + 'a');
+	msg_byte(&m, n);
+	for (i = 0; i < n; i++)
+		msg_word(&m, words[i]);
+
+	issue(&m, NO_DATA);
+	if (stop_and_wait)
+		drain_commands();
+}
+
+/*
+ * Write n bytes into data memory, from the address on.  The arduino
+ * waits out each write and increments the address past it.
+ */
+static void
+send_data_bytes(int *bytes, int n)
+{
+	int i;
+	struct msg m;
+
+	if (verbose)
+		printf("Writing %d data bytes\n", n);
+
+	msg_start(&m, WriteDataBytes + 'a');
+	msg_byte(&m, n);
+	for (i = 0; i < n; i++)
+		msg_byte(&m, bytes[i]);
+
+	issue(&m, NO_DATA);
+	if (stop_and_wait)
+		drain_commands();
+}
+
+/*
+ * Move the address on by n words, in one command if the arduino
+ * has Advance Address.
+ */
+static void
+advance_address(int n)
+{
+	struct msg m;
+
+	if (n <= 0)
+		return;
+	if (!has_command(AdvanceAddress)) {
+		while (n-- > 0)
+			queue_command(IncrementAddress, 0);
+		return;
+	}
+	if (verbose)
+		printf("Advancing %d words\n", n);
+	msg_start(&m, AdvanceAddress + 'a');
+	msg_word(&m, n);
+	issue(&m, NO_DATA);
+	if (stop_and_wait)
+		drain_commands();
+}
+
+/*
+ * Enters programming mode on the PIC
+ */
+static void
+enter_program_mode()
+{
+	int c;
+
+	c = send_control('E', 1);
+	if (c != 'Y') {
+		fprintf(stderr, "%s: failed to enter programming mode.\n",
+			myname);
+		exit(1);
+	}
+
+	if (verbose)
+		printf("Now in programming mode\n");
+}
+
+#define	BLANK_WORD	0x3fff
+
+/*
+ * Move the address to the start of config memory.  Load Configuration
+ * loads a latch as well, and the next row written programs every
+ * latch, so the word it loads is a blank one.
+ */
+static void
+to_config()
+{
+	send_command(LoadConfiguration, BLANK_WORD);
+}
+
+/*
+ * This routine can print program or config space.
+ */
+static void
+do_print1()
+{
+	int i;
+	int t;
+	int data[11 * MAX_TARGETS];
+
+	if (print & PRINT_CONFIG) {
+		to_config();
+		printf("\nPrinting Configuration Registers\n");
+	} else {
+		printf("\nPrinting first 11 words of program memmory.\n");
+		send_command(ResetAddress, 0);
+	}
+
+	read_memory(0, data, 11);
+	for (i = 0; i < 11; i++) {
+		printf("\t%04x ", i);
+		for (t = 0; t < targets; t++)
+			printf(" %04x", data[i * targets + t]);
+		printf("\n");
+	}
+}
+
+/*
+ * This routine can print data space
+ */
+static void
+do_print2()
+{
+	int i;
+	int t;
+	int data[10 * MAX_TARGETS];
+
+	printf("\nPrinting first 10 words of Data Memory\n");
+	send_command(ResetAddress, 0);
+	read_memory(1, data, 10);
+	for (i = 0; i < 10; i++) {
+		printf("\t  %02x  ", i);
+		for (t = 0; t < targets; t++)
+			printf("  %02x", data[i * targets + t] & 0xff);
+		printf("\n");
+	}
+}
+
+/*
+ * Print all of program memory, config space and data memory, of each
+ * target in turn.
+ */
+static void
+do_dump()
+{
+	int i;
+	int t;
+	int program[PIC_PROGRAM_WORDS * MAX_TARGETS];
+	int config[PIC_CONFIG_WORDS * MAX_TARGETS];
+	int data[PIC_DATA_BYTES * MAX_TARGETS];
+
+	send_command(ResetAddress, 0);
+	read_memory(0, program, PIC_PROGRAM_WORDS);
+	to_config();
+	read_memory(0, config, PIC_CONFIG_WORDS);
+	send_command(ResetAddress, 0);
+	read_memory(1, data, PIC_DATA_BYTES);
+
+	for (t = 0; t < targets; t++) {
+		if (targets > 1)
+			printf("\nTarget %d\n", t);
+
+		printf("\nProgram memory\n");
+		for (i = 0; i < PIC_PROGRAM_WORDS; i++)
+			printf("%s%04x", i % 8 == 0 ? "\n\t" : " ",
+				program[i * targets + t]);
+
+		printf("\n\nConfiguration memory\n");
+		for (i = 0; i < PIC_CONFIG_WORDS; i++)
+			printf("%s%04x", i % 8 == 0 ? "\n\t" : " ",
+				config[i * targets + t]);
+
+		printf("\n\nData memory\n");
+		for (i = 0; i < PIC_DATA_BYTES; i++)
+			printf("%s%02x", i % 16 == 0 ? "\n\t" : " ",
+				data[i * targets + t] & 0xff);
+		printf("\n");
+	}
+}
+
+/* The next word we receive goes here. */
+int pic_address;
+
+/*
+ * Words the PIC's address is behind pic_address while verifying.
+ * Made up just before the next read.
+ */
+int skip_words;
+
+/*
+ * When the arduino can read a run of words, words to verify are
+ * collected here with their line numbers.
+ */
+int verify_data[MAX_READ];
+int verify_lines[MAX_READ];
+int words_to_verify;
+
+/*
+ * When programming, or verifying with CRC Words or in gang mode, the
+ * whole image is collected here and dealt with once the input is
+ * read.  A line number of 0 means the word isn't in the image, and it
+ * is left blank.
+ */
+int image_verify;
+int image[PIC_PROGRAM_WORDS];
+int image_lines[PIC_PROGRAM_WORDS];
+int config_image[PIC_CONFIG_WORDS];
+int config_lines[PIC_CONFIG_WORDS];
+int data_image[PIC_DATA_BYTES];		/* data EEPROM */
+int data_lines[PIC_DATA_BYTES];
+
+/*
+ * How many words the arduino can take in one Load Row, or 0 if it
+ * can't.  A frame must fit in its receive buffer, so a small one
+ * takes a row in pieces; programming a piece rewrites the words
+ * already there, which changes nothing.  In hex a whole row is longer
+ * than the buffer, but the arduino reads it as it arrives, and
+ * acknowledges it once written, so it goes in one.
+ */
+static int
+load_row_words()
+{
+	int n;
+
+	if (!has_command(LoadRow))
+		return 0;
+	if (!framed)
+		return PIC_NUMBER_OF_LATCHES;
+	n = (window - 5 - 2) / 2;
+	if (n < 0)
+		return 0;
+	return n < PIC_NUMBER_OF_LATCHES ? n : PIC_NUMBER_OF_LATCHES;
+}
+
+static void
+catch_up()
+{
+	advance_address(skip_words);
+	skip_words = 0;
+}
+
+static void
+flush_reads()
+{
+	if (words_to_verify > 0) {
+		catch_up();
+		queue_read(0, words_to_verify, NULL,
+			verify_data, verify_lines);
+	}
+	words_to_verify = 0;
+}
+
+
+/*
+ * CRC-32 of n words of the image from addr on, as the arduino
+ * would compute it.
+ */
+static unsigned long
+image_crc(int addr, int n)
+{
+	unsigned long crc;
+
+	crc = 0xffffffff;
+	for (; n > 0; n--, addr++) {
+		crc = crc32_update(crc, image[addr] & 0xff);
+		crc = crc32_update(crc, image[addr] >> 8);
+	}
+	return ~crc & 0xffffffff;
+}
+
+/*
+ * Move the PIC's address from from to to.  Returns to.
+ */
+static int
+seek_address(int from, int to)
+{
+	if (to < from) {
+		queue_command(ResetAddress, 0);
+		from = 0;
+	}
+	advance_address(to - from);
+	return to;
+}
+
+/*
+ * Do the targets still in play hold the image from a up to b?  The
+ * address must be at a.
+ */
+static int
+crc_matches(int a, int b)
+{
+	unsigned long crc[MAX_TARGETS];
+	unsigned long want;
+	int matches;
+	int t;
+
+	crc_memory(0, b - a, crc);
+	want = image_crc(a, b - a);
+	matches = 1;
+	for (t = 0; t < targets; t++) {
+		if (!(live & 1 << t))
+			continue;
+		if (verbose)
+			printf("\t%s%04x-%04x: CRC %08lx, image %08lx\n",
+				target_name(t), a, b - 1, crc[t], want);
+		if (crc[t] != want)
+			matches = 0;
+	}
+	return matches;
+}
+
+/*
+ * Read back the image words from a up to b, with the address at a,
+ * and report the first that is wrong.  Returns the address left
+ * behind.
+ */
+static int
+read_back(int a, int b)
+{
+	int i;
+	int k;
+
+	if (verbose)
+		printf("Reading back %04x-%04x\n", a, b - 1);
+	for (i = a; i < b; i += k) {
+		if (read_max() == 0) {
+			queue_verify(ReadDatafromProgramMemory,
+				image[i], image_lines[i]);
+			queue_command(IncrementAddress, 0);
+			k = 1;
+			continue;
+		}
+		k = b - i < read_max() ? b - i : read_max();
+		queue_read(0, k, NULL, image + i, image_lines + i);
+	}
+	drain_commands();
+	return b;
+}
+
+/*
+ * Verify the run of image words from a up to b, with the address at
+ * a.  If the CRC of the run is wrong, find the first row that is
+ * wrong by halving the run, and read that row back to report the
+ * first bad word.  Without CRC Words the whole run is read back.
+ * Returns the address left behind.
+ *
+ * With several targets, the row found is the first that any of them
+ * has wrong, and the others may go wrong later in the run.  So it is
+ * done again until the run is right, which takes at most a try for
+ * each target, as each try gives up on at least one.
+ */
+static int
+verify_run(int a, int b)
+{
+	int lo;
+	int hi;
+	int mid;
+	int addr;
+	int try;
+
+	if (!has_command(CRCWords))
+		return read_back(a, b);
+
+	addr = a;
+	for (try = 0; try < targets; try++) {
+		addr = seek_address(addr, a);
+		if (crc_matches(a, b))
+			return b;
+
+		/*
+		 * The run is wrong, so if the first half is right the
+		 * second half is wrong.
+		 */
+		lo = a;
+		hi = b;
+		addr = b;
+		while (lo / PIC_NUMBER_OF_LATCHES !=
+		    (hi - 1) / PIC_NUMBER_OF_LATCHES) {
+			mid = lo + (hi - lo) / 2;
+			mid -= mid % PIC_NUMBER_OF_LATCHES;
+			if (mid <= lo)
+				mid = lo - lo % PIC_NUMBER_OF_LATCHES +
+					PIC_NUMBER_OF_LATCHES;
+			addr = seek_address(addr, lo);
+			if (crc_matches(lo, mid))
+				lo = mid;
+			else
+				hi = mid;
+			addr = mid;
+		}
+
+		seek_address(addr, lo);
+		addr = read_back(lo, hi);
+	}
+	return addr;
+}
+
+/*
+ * Check the PIC against the image collected by read_input(), a run of
+ * consecutive words at a time.
+ */
+static void
+verify_image()
+{
+	int a;
+	int b;
+	int addr;
+
+	queue_command(ResetAddress, 0);
+	addr = 0;
+	for (a = 0; a < PIC_PROGRAM_WORDS; a = b) {
+		b = a + 1;
+		if (image_lines[a] == 0)
+			continue;
+		while (b < PIC_PROGRAM_WORDS && image_lines[b] != 0)
+			b++;
+		addr = seek_address(addr, a);
+		addr = verify_run(a, b);
+	}
+}
+
+#define	ERASE_ROWS	(PIC_PROGRAM_WORDS / PIC_ERASE_ROW)
+
+/*
+ * Programming is planned before anything is sent.  The image is
+ * turned into a list of steps, each a PIC command or one of the
+ * arduino's Load Row and Advance Address, in the order that wants the
+ * fewest commands and bytes on the wire.  The plan keeps track of
+ * where the PIC's address will be as it goes, so each move is made the
+ * cheapest way.
+ */
+struct step {
+	int command;
+	int data;		/* data word, or a word count */
+	int *words;		/* Load Row's words, or where a CRC goes */
+	int loaded;		/* program memory below is written after it */
+};
+
+#define	MAX_STEPS	(3 * PIC_PROGRAM_WORDS + 3 * ERASE_ROWS + \
+			4 * PIC_CONFIG_WORDS + 8)
+
+struct step plan[MAX_STEPS];
+int plan_steps;
+int plan_address;		/* where the address is after the steps */
+int plan_only;			/* -N: print the plan's cost, don't run it */
+int check;			/* check what's written, unless -c */
+
+/*
+ * The CRC of each erase row checked as it was written, for
+ * rows_failed().
+ */
+int row_crc[ERASE_ROWS][2 * MAX_TARGETS];
+char row_checked[ERASE_ROWS];
+
+/*
+ * What -N plans for, without an arduino to ask: the sketch in this
+ * tree, on a board with a 64 byte receive buffer.
+ */
+#define	PLAN_CAPABILITIES	CAPABILITIES "R8W63"
+
+static void
+plan_add(int command, int data, int *words)
+{
+	struct step *s;
+
+	if (plan_steps == MAX_STEPS) {
+		fprintf(stderr, "%s: plan too long\n", myname);
+		exit(1);
+	}
+	s = &plan[plan_steps++];
+	s->command = command;
+	s->data = data;
+	s->words = words;
+	s->loaded = 0;
+}
+
+/*
+ * Bytes a step puts on the wire.
+ */
+static int
+step_bytes(struct step *s)
+{
+	int i;
+	struct msg m;
+
+	msg_start(&m, s->command + 'a');
+	switch (s->command) {
+	    case LoadRow:
+		msg_byte(&m, s->data);
+		for (i = 0; i < s->data; i++)
+			msg_word(&m, s->words[i]);
+		break;
+	    case WriteDataBytes:
+		msg_byte(&m, s->data);
+		for (i = 0; i < s->data; i++)
+			msg_byte(&m, s->words[i]);
+		break;
+	    case CRCWords:
+		msg_byte(&m, 0);
+		msg_word(&m, s->data);
+		break;
+	    case AdvanceAddress:
+	    case LoadConfiguration:
+	    case LoadDataforProgramMemory:
+	    case LoadDataforDataMemory:
+		msg_word(&m, s->data);
+		break;
+	}
+	return framed ? m.len + 5 : m.len;
+}
+
+/*
+ * Move the planned address to addr.  Going back means starting again
+ * from 0.  Without Advance Address that may also be the shorter way
+ * forward.
+ */
+static void
+plan_seek(int addr)
+{
+	int n;
+	struct step s;
+
+	n = addr - plan_address;
+	if (n == 0)
+		return;
+	if (n < 0 || (!has_command(AdvanceAddress) && addr + 1 < n)) {
+		plan_add(ResetAddress, 0, NULL);
+		n = addr;
+	}
+	if (n == 0)
+		;
+	else if (has_command(AdvanceAddress)) {
+		/* Increments win over a short distance in hex. */
+		s.command = AdvanceAddress;
+		s.data = n;
+		if (n * (framed ? 6 : 1) <= step_bytes(&s))
+			while (n-- > 0)
+				plan_add(IncrementAddress, 0, NULL);
+		else
+			plan_add(AdvanceAddress, n, NULL);
+	} else
+		while (n-- > 0)
+			plan_add(IncrementAddress, 0, NULL);
+	plan_address = addr;
+}
+
+/*
+ * Plan programming the row of latches at r, leaving out erased words.
+ * Returns 0 if there is nothing to write.
+ */
+static int
+plan_row(int r)
+{
+	int a;
+	int first;
+	int last;
+	int end;
+	int n;
+
+	/* Programming an erased word changes nothing. */
+	for (first = r; first < r + PIC_NUMBER_OF_LATCHES &&
+	    image[first] == BLANK_WORD; first++)
+		;
+	if (first == r + PIC_NUMBER_OF_LATCHES)
+		return 0;
+	for (last = r + PIC_NUMBER_OF_LATCHES - 1;
+	    image[last] == BLANK_WORD; last--)
+		;
+
+	n = load_row_words();
+	if (n > 0) {
+		for (a = first; a <= last; a = end + 1) {
+			while (image[a] == BLANK_WORD)
+				a++;
+			end = a + n - 1 < last ? a + n - 1 : last;
+			while (image[end] == BLANK_WORD)
+				end--;
+			plan_seek(a);
+			plan_add(LoadRow, end - a + 1, image + a);
+			plan_address = end + 1;
+		}
+		plan[plan_steps - 1].loaded = r + PIC_NUMBER_OF_LATCHES;
+		return 1;
+	}
+
+	/*
+	 * The row is programmed once its last word is loaded,
+	 * before the address leaves it.
+	 */
+	for (a = first; a <= last; a++) {
+		if (image[a] == BLANK_WORD)
+			continue;
+		plan_seek(a);
+		plan_add(LoadDataforProgramMemory, image[a], NULL);
+		if (a == last) {
+			plan_add(BeginProgramming, 0, NULL);
+			plan[plan_steps - 1].loaded = r + PIC_NUMBER_OF_LATCHES;
+		}
+		plan_add(IncrementAddress, 0, NULL);
+		plan_address++;
+	}
+	return 1;
+}
+
+/*
+ * With -e, the words of program memory the image leaves out keep what
+ * they had, so they can't be checked, or erased to fix a word that's
+ * wrong.  An incremental load erases each row it writes.
+ */
+static int
+keeping_memory()
+{
+	return erase_mode == ERASE_NOT && !incremental;
+}
+
+/*
+ * Do we know what word a of program memory should hold?
+ */
+static int
+word_known(int a)
+{
+	return image_lines[a] != 0 || !keeping_memory();
+}
+
+/*
+ * Can each erase row be checked as soon as it's written?  That takes
+ * going back to its start, a Reset and an Advance Address, and a CRC,
+ * which only works if we know what every word of the row should be.
+ */
+static int
+checking_rows()
+{
+	return check && has_command(CRCWords) &&
+		has_command(AdvanceAddress) && !keeping_memory();
+}
+
+/*
+ * Plan programming the image into program memory, one row of latches
+ * at a time.  If rows isn't NULL, only the erase rows it marks are
+ * done, and if erase is set each one is erased first.  Each erase row
+ * written is then checked, if checking_rows().
+ */
+static void
+plan_program(char *rows, int erase)
+{
+	int r;
+	int e;
+	int wrote;
+
+	wrote = 0;
+	for (r = 0; r < PIC_PROGRAM_WORDS; r += PIC_NUMBER_OF_LATCHES) {
+		e = r / PIC_ERASE_ROW;
+		if (rows && !rows[e])
+			continue;
+		if (rows && erase && r % PIC_ERASE_ROW == 0) {
+			plan_seek(r);
+			plan_add(RowEraseProgramMemory, 0, NULL);
+			wrote = 1;
+		}
+		wrote |= plan_row(r);
+
+		if ((r + PIC_NUMBER_OF_LATCHES) % PIC_ERASE_ROW != 0 ||
+		    !wrote)
+			continue;
+		wrote = 0;
+		if (!checking_rows())
+			continue;
+		plan_seek(e * PIC_ERASE_ROW);
+		plan_add(CRCWords, PIC_ERASE_ROW, row_crc[e]);
+		plan_address += PIC_ERASE_ROW;
+		row_checked[e] = 1;
+	}
+}
+
+/*
+ * Plan programming the config words in the image, or only those
+ * marked in change if it isn't NULL.  Load Configuration moves the
+ * address to the start of config memory, and the first word goes in
+ * with it.  Config memory is written last, so code protection can't
+ * get in the way of the rest.
+ */
+static void
+plan_config(char *change)
+{
+	int i;
+	int loaded;
+
+	loaded = 0;
+	for (i = 0; i < PIC_CONFIG_WORDS; i++) {
+		if (config_lines[i] == 0 || (change && !change[i]))
+			continue;
+		if (!loaded) {
+			plan_add(LoadConfiguration, config_image[i], NULL);
+			plan_address = 0;
+			plan_seek(i);
+			loaded = 1;
+		} else {
+			plan_seek(i);
+			plan_add(LoadDataforProgramMemory, config_image[i],
+				NULL);
+		}
+		plan_add(BeginProgramming, 0, NULL);
+	}
+}
+
+/*
+ * Plan writing the data memory bytes in the image, or only those
+ * marked in change if it isn't NULL.  Bytes that are erased already
+ * are left out when erased is set.  Each byte is erased as it's
+ * written, so any of them can be written again.  Data memory is the
+ * low 8 bits of the address, so it's reached from past its end by a
+ * Reset.  Write Data Bytes writes up to a row of them at once, the
+ * arduino timing each one.
+ */
+static int
+data_wanted(char *change, int erased, int a)
+{
+	return data_lines[a] != 0 && (change == NULL || change[a]) &&
+		!(erased && data_image[a] == 0xff);
+}
+
+static void
+plan_data(char *change, int erased)
+{
+	int a;
+	int n;
+
+	for (a = 0; a < PIC_DATA_BYTES; a++) {
+		if (!data_wanted(change, erased, a))
+			continue;
+		plan_seek(a);
+		if (!has_command(WriteDataBytes)) {
+			plan_add(LoadDataforDataMemory, data_image[a], NULL);
+			plan_add(BeginProgramming, 0, NULL);
+			plan_add(IncrementAddress, 0, NULL);
+			plan_address++;
+			continue;
+		}
+		for (n = 1; n < PIC_NUMBER_OF_LATCHES &&
+		    a + n < PIC_DATA_BYTES &&
+		    data_wanted(change, erased, a + n); n++)
+			;
+		plan_add(WriteDataBytes, n, data_image + a);
+		plan_address += n;
+		a += n - 1;
+	}
+}
+
+/*
+ * Print what the plan will cost: commands, and bytes each way.  Each
+ * reply is a status letter, in a frame or followed by CR LF.
+ */
+static void
+plan_report()
+{
+	int i;
+	long out;
+	struct step *s;
+
+	out = 0;
+	for (i = 0; i < plan_steps; i++) {
+		s = &plan[i];
+		out += step_bytes(s);
+		if (verbose && plan_only)
+			printf("\t%c %04x\n", s->command + 'a', s->data);
+	}
+	printf("Plan: %d commands, %ld bytes to the arduino, %d back\n",
+		plan_steps, out, plan_steps * (framed ? 6 : 3));
+}
+
+static void
+run_plan()
+{
+	int i;
+	struct step *s;
+
+	if (verbose || plan_only)
+		plan_report();
+	if (plan_only)
+		return;
+
+	for (i = 0; i < plan_steps; i++) {
+		s = &plan[i];
+		step_loaded = s->loaded;
+		switch (s->command) {
+		    case LoadRow:
+			send_row(s->words, s->data);
+			break;
+		    case WriteDataBytes:
+			send_data_bytes(s->words, s->data);
+			break;
+		    case AdvanceAddress:
+			advance_address(s->data);
+			break;
+		    case CRCWords:
+			queue_crc(0, s->data, s->words);
+			break;
+		    default:
+			queue_command(s->command, s->data);
+			break;
+		}
+	}
+	drain_commands();
+}
+
+/*
+ * Mark the erase rows of program memory that don't hold the image
+ * already, on any target still in play.  Uses a CRC per row if the
+ * arduino can, or else reads the whole memory back, as it does to
+ * check only the image's words with -e.  Returns how many
+ * rows are marked, and leaves the address at the end of program
+ * memory.
+ */
+static int
+find_changed_rows(char *changed)
+{
+	int r;
+	int n;
+	int a;
+	int i;
+	int t;
+	int use_crc;
+	unsigned long want;
+	int crc[ERASE_ROWS][2 * MAX_TARGETS];
+	int data[PIC_PROGRAM_WORDS * MAX_TARGETS];
+
+	use_crc = has_command(CRCWords) && !keeping_memory();
+	queue_command(ResetAddress, 0);
+	if (use_crc) {
+		for (r = 0; r < ERASE_ROWS; r++)
+			queue_crc(0, PIC_ERASE_ROW, crc[r]);
+		drain_commands();
+	} else
+		read_memory(0, data, PIC_PROGRAM_WORDS);
+
+	n = 0;
+	for (r = 0; r < ERASE_ROWS; r++) {
+		a = r * PIC_ERASE_ROW;
+		want = image_crc(a, PIC_ERASE_ROW);
+		changed[r] = 0;
+		for (t = 0; t < targets; t++) {
+			if (!(live & 1 << t))
+				continue;
+			if (use_crc)
+				changed[r] |= crc_of(crc[r], t) != want;
+			else
+				for (i = a; i < a + PIC_ERASE_ROW; i++)
+					changed[r] |= word_known(i) &&
+						data[i * targets + t] != image[i];
+		}
+		n += changed[r];
+	}
+	return n;
+}
+
+/*
+ * Does target t, still in play, hold something other than config
+ * word i of the image?  data is as config_differs() reads it.
+ */
+static int
+config_wrong(int *data, int i, int t)
+{
+	return (live & 1 << t) && config_lines[i] != 0 &&
+		data[i * targets + t] != config_image[i];
+}
+
+/*
+ * Mark the config words in the image that any target doesn't hold,
+ * and return how many there are.  What they hold goes in data, a word
+ * from each target for each word.
+ */
+static int
+config_differs(char *changed, int *data)
+{
+	int i;
+	int t;
+	int n;
+
+	to_config();
+	read_memory(0, data, PIC_CONFIG_WORDS);
+	n = 0;
+	for (i = 0; i < PIC_CONFIG_WORDS; i++) {
+		changed[i] = 0;
+		for (t = 0; t < targets; t++)
+			changed[i] |= config_wrong(data, i, t);
+		n += changed[i];
+	}
+	return n;
+}
+
+/*
+ * Mark the config words in the image that the PIC doesn't hold
+ * already.  Without a bulk erase programming can only clear bits, so
+ * give up on a target if one needs a bit set.
+ */
+static void
+find_changed_config(char *changed)
+{
+	int i;
+	int t;
+	int d;
+	int data[PIC_CONFIG_WORDS * MAX_TARGETS];
+
+	config_differs(changed, data);
+	for (t = 0; t < targets; t++)
+		for (i = 0; i < PIC_CONFIG_WORDS; i++) {
+			d = data[i * targets + t];
+			if (config_wrong(data, i, t) &&
+			    (d & config_image[i]) != config_image[i]) {
+				fprintf(stderr, "%s: %sconfig word on line %d "
+						"can't go from %04x to %04x "
+						"without a bulk erase; load "
+						"without -i\n",
+					myname, target_name(t),
+					config_lines[i], d, config_image[i]);
+				fail_target(t);
+				break;
+			}
+		}
+}
+
+/*
+ * Check the config words in the image against the PIC, for -V.
+ */
+static void
+verify_config()
+{
+	int i;
+	int t;
+	int data[PIC_CONFIG_WORDS * MAX_TARGETS];
+	char changed[PIC_CONFIG_WORDS];
+
+	for (i = 0; i < PIC_CONFIG_WORDS && config_lines[i] == 0; i++)
+		;
+	if (i == PIC_CONFIG_WORDS)
+		return;
+	if (config_differs(changed, data) == 0)
+		return;
+	for (t = 0; t < targets; t++) {
+		for (i = 0; i < PIC_CONFIG_WORDS; i++)
+			if (config_wrong(data, i, t))
+				break;
+		if (i == PIC_CONFIG_WORDS)
+			continue;
+		fprintf(stderr, "%s: %sverify error on line %d\n",
+			myname, target_name(t), config_lines[i]);
+		if (verbose)
+			fprintf(stderr, "\tExpected %x \t-- Got %x\n",
+				config_image[i], data[i * targets + t]);
+		fail_target(t);
+	}
+}
+
+/*
+ * Does the image have anything for data memory?
+ */
+static int
+has_data()
+{
+	int i;
+
+	for (i = 0; i < PIC_DATA_BYTES; i++)
+		if (data_lines[i] != 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Does target t, still in play, hold something other than data byte
+ * i of the image?  data is as data_differs() reads it.
+ */
+static int
+data_wrong(int *data, int i, int t)
+{
+	return (live & 1 << t) && data_lines[i] != 0 &&
+		(data[i * targets + t] & 0xff) != data_image[i];
+}
+
+/*
+ * Mark the data bytes in the image that any target doesn't hold, and
+ * return how many there are.  Each run of bytes in the image is read
+ * back with Read Words, and what they hold goes in data, a byte from
+ * each target for each byte.
+ */
+static int
+data_differs(char *changed, int *data)
+{
+	int a;
+	int b;
+	int i;
+	int t;
+	int n;
+	int addr;
+
+	queue_command(ResetAddress, 0);
+	addr = 0;
+	for (a = 0; a < PIC_DATA_BYTES; a = b) {
+		b = a + 1;
+		if (data_lines[a] == 0)
+			continue;
+		while (b < PIC_DATA_BYTES && data_lines[b] != 0)
+			b++;
+		addr = seek_address(addr, a);
+		read_memory(1, data + a * targets, b - a);
+		addr = b;
+	}
+
+	n = 0;
+	for (i = 0; i < PIC_DATA_BYTES; i++) {
+		changed[i] = 0;
+		for (t = 0; t < targets; t++)
+			changed[i] |= data_wrong(data, i, t);
+		n += changed[i];
+	}
+	return n;
+}
+
+/*
+ * Check the data bytes in the image against the PIC, for -V.
+ */
+static void
+verify_data_memory()
+{
+	int i;
+	int t;
+	int data[PIC_DATA_BYTES * MAX_TARGETS];
+	char changed[PIC_DATA_BYTES];
+
+	if (!has_data() || data_differs(changed, data) == 0)
+		return;
+	for (t = 0; t < targets; t++) {
+		for (i = 0; i < PIC_DATA_BYTES; i++)
+			if (data_wrong(data, i, t))
+				break;
+		if (i == PIC_DATA_BYTES)
+			continue;
+		fprintf(stderr, "%s: %sverify error on line %d\n",
+			myname, target_name(t), data_lines[i]);
+		if (verbose)
+			fprintf(stderr, "\tExpected %x \t-- Got %x\n",
+				data_image[i], data[i * targets + t] & 0xff);
+		fail_target(t);
+	}
+}
+
+/*
+ * Unless -c, each part of the image is checked once it's written,
+ * and what's wrong is written again, up to CHECK_RETRIES times,
+ * before giving up.
+ *
+ * Each erase row of program memory is checked by a CRC straight after
+ * it's written (see plan_program()).  The CRCs come back while later
+ * rows are going in, so rather than stop for each one, the rows that
+ * fail are written again together once the last row is.  An arduino
+ * without CRC Words or Advance Address can't go back to a row cheaply,
+ * so then the rows are checked in one pass at the end, and so they are
+ * with -e, reading back only the image's words.  With -e a wrong row
+ * can't be erased either, and is only written again.  Data memory and
+ * then config memory are written and checked after that, as code
+ * protection would hide the others.
+ */
+#define	CHECK_RETRIES	3
+
+/*
+ * Say what's still wrong in the marked rows, giving up on each target
+ * that has a word wrong.
+ */
+static void
+report_rows(char *bad)
+{
+	int r;
+	int a;
+	int i;
+	int t;
+	int w;
+	int addr;
+	int found;
+	int data[PIC_ERASE_ROW * MAX_TARGETS];
+
+	queue_command(ResetAddress, 0);
+	addr = 0;
+	found = 0;
+	for (r = 0; r < ERASE_ROWS; r++) {
+		if (!bad[r])
+			continue;
+		a = r * PIC_ERASE_ROW;
+		addr = seek_address(addr, a);
+		read_memory(0, data, PIC_ERASE_ROW);
+		addr += PIC_ERASE_ROW;
+		for (t = 0; t < targets; t++) {
+			for (i = 0; i < PIC_ERASE_ROW; i++)
+				if ((live & 1 << t) && word_known(a + i) &&
+				    data[i * targets + t] != image[a + i])
+					break;
+			if (i == PIC_ERASE_ROW)
+				continue;
+			w = data[i * targets + t];
+			if (image_lines[a + i] == 0)
+				fprintf(stderr, "%s: %sword %04x is %04x, "
+						"not erased, after %d "
+						"rewrites\n",
+					myname, target_name(t), a + i, w,
+					CHECK_RETRIES);
+			else {
+				fprintf(stderr, "%s: %sverify error on line "
+						"%d after %d rewrites\n",
+					myname, target_name(t),
+					image_lines[a + i], CHECK_RETRIES);
+				if (verbose)
+					fprintf(stderr, "\tExpected %x "
+							"\t-- Got %x\n",
+						image[a + i], w);
+			}
+			found++;
+			fail_target(t);
+		}
+	}
+	if (found == 0) {
+		for (r = 0; !bad[r]; r++)
+			;
+		fprintf(stderr, "%s: row at %04x keeps failing its check\n",
+			myname, r * PIC_ERASE_ROW);
+		exit(1);
+	}
+}
+
+/*
+ * Mark the erase rows whose CRC, taken as they were written, isn't the
+ * image's on a target still in play.  Returns how many are marked.
+ */
+static int
+rows_failed(char *bad)
+{
+	int r;
+	int t;
+	int n;
+	unsigned long want;
+
+	n = 0;
+	for (r = 0; r < ERASE_ROWS; r++) {
+		bad[r] = 0;
+		if (!row_checked[r])
+			continue;
+		row_checked[r] = 0;
+		want = image_crc(r * PIC_ERASE_ROW, PIC_ERASE_ROW);
+		for (t = 0; t < targets; t++)
+			if ((live & 1 << t) && crc_of(row_crc[r], t) != want)
+				bad[r] = 1;
+		n += bad[r];
+	}
+	return n;
+}
+
+/*
+ * Check program memory against the image and rewrite the erase rows
+ * that are wrong, erasing them first if the arduino can.
+ */
+static void
+check_rows()
+{
+	int try;
+	int n;
+	char bad[ERASE_ROWS];
+
+	for (try = 0; ; try++) {
+		if (checking_rows())
+			n = rows_failed(bad);
+		else
+			n = find_changed_rows(bad);
+		if (n == 0)
+			return;
+		if (try == CHECK_RETRIES) {
+			report_rows(bad);
+			return;
+		}
+		if (verbose)
+			printf("%d rows wrong, writing them again\n", n);
+		plan_steps = 0;
+		plan_address = PIC_PROGRAM_WORDS;
+		plan_program(bad, has_command(RowEraseProgramMemory) &&
+			!keeping_memory());
+		run_plan();
+	}
+}
+
+/*
+ * Check the config words and write the wrong ones again.  A bit that
+ * reads 0 but should be 1 can't be fixed that way.
+ */
+static void
+check_config()
+{
+	int try;
+	int i;
+	int t;
+	int d;
+	int data[PIC_CONFIG_WORDS * MAX_TARGETS];
+	char changed[PIC_CONFIG_WORDS];
+
+	for (try = 0; ; try++) {
+		if (config_differs(changed, data) == 0)
+			return;
+		for (t = 0; t < targets; t++)
+			for (i = 0; i < PIC_CONFIG_WORDS; i++) {
+				d = data[i * targets + t];
+				if (!config_wrong(data, i, t) ||
+				    (try < CHECK_RETRIES &&
+				    (d & config_image[i]) == config_image[i]))
+					continue;
+				fprintf(stderr, "%s: %sconfig word on line %d "
+						"reads %04x, not %04x\n",
+					myname, target_name(t),
+					config_lines[i], d, config_image[i]);
+				fail_target(t);
+				break;
+			}
+		if (try == CHECK_RETRIES)
+			return;
+		if (verbose)
+			printf("Writing config words again\n");
+		plan_steps = 0;
+		plan_config(changed);
+		run_plan();
+	}
+}
+
+/*
+ * Check the data bytes and write the wrong ones again.
+ */
+static void
+check_data()
+{
+	int try;
+	int i;
+	int t;
+	int n;
+	int data[PIC_DATA_BYTES * MAX_TARGETS];
+	char changed[PIC_DATA_BYTES];
+
+	for (try = 0; ; try++) {
+		n = data_differs(changed, data);
+		if (n == 0)
+			return;
+		if (try == CHECK_RETRIES)
+			break;
+		if (verbose)
+			printf("%d data bytes wrong, writing them again\n", n);
+		plan_steps = 0;
+		plan_address = PIC_DATA_BYTES;
+		plan_data(changed, 0);
+		run_plan();
+	}
+
+	for (t = 0; t < targets; t++)
+		for (i = 0; i < PIC_DATA_BYTES; i++) {
+			if (!data_wrong(data, i, t))
+				continue;
+			fprintf(stderr, "%s: %sdata byte on line %d reads "
+					"%02x, not %02x, after %d rewrites\n",
+				myname, target_name(t), data_lines[i],
+				data[i * targets + t] & 0xff, data_image[i],
+				CHECK_RETRIES);
+			fail_target(t);
+			break;
+		}
+}
+
+/*
+ * Does the image give any words in erase row r?
+ */
+static int
+row_in_image(int r)
+{
+	int a;
+
+	for (a = r * PIC_ERASE_ROW; a < (r + 1) * PIC_ERASE_ROW; a++)
+		if (image_lines[a] != 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Program the image collected by read_input().
  *
- * The Arduino is on fd, the data comes in on FILE input.
+ * In incremental mode, only the rows of program memory that differ
+ * from the image are erased and rewritten, and only the data bytes
+ * and config words that differ are written.  Otherwise the plan
+ * starts with the bulk erases, unless -e, or carries on from loaded
+ * if it isn't 0, erasing only the rows from there on.  Data memory is written after
+ * program memory, and config memory last.  Unless -c, each is
+ * checked before the next is written.
+ */
+static void
+program_image()
+{
+	int i;
+	int n;
+	char rows[ERASE_ROWS];
+	char config[PIC_CONFIG_WORDS];
+	char data[PIC_DATA_BYTES];
+	int held[PIC_DATA_BYTES * MAX_TARGETS];
+	int checking;
+
+	/* -N plans the checks of each row, but can't make the others */
+	checking = check && !plan_only;
+	plan_steps = 0;
+	plan_address = 0;
+	if (!incremental && loaded > 0) {
+		/* The rest was erased before the load stopped */
+		for (i = 0; i < ERASE_ROWS; i++)
+			rows[i] = (i + 1) * PIC_ERASE_ROW > loaded &&
+				row_in_image(i);
+		plan_program(rows, has_command(RowEraseProgramMemory));
+	} else if (!incremental) {
+		if (erase_mode == ERASE_AND_LOAD) {
+			plan_add(BulkEraseProgramMemory, 0, NULL);
+			plan_add(BulkEraseDataMemory, 0, NULL);
+		}
+		plan_program(NULL, 0);
+	} else {
+		memset(config, 0, sizeof config);
+		for (i = 0; i < PIC_CONFIG_WORDS; i++)
+			if (config_lines[i] != 0) {
+				find_changed_config(config);
+				break;
+			}
+
+		memset(data, 0, sizeof data);
+		if (has_data())
+			data_differs(data, held);
+
+		n = find_changed_rows(rows);
+		if (verbose)
+			printf("%d of %d rows changed\n", n, ERASE_ROWS);
+
+		plan_address = PIC_PROGRAM_WORDS;
+		plan_program(rows, 1);
+	}
+
+	if (checking) {
+		run_plan();
+		check_rows();
+		plan_steps = 0;
+		plan_address = PIC_DATA_BYTES;	/* anywhere past data memory */
+	}
+	plan_data(incremental ? data : NULL,
+		!incremental && erase_mode == ERASE_AND_LOAD);
+	if (checking && has_data()) {
+		run_plan();
+		check_data();
+		plan_steps = 0;
+	}
+	plan_config(incremental ? config : NULL);
+	run_plan();
+	if (checking)
+		check_config();
+}
+
+/*
+ * A load that loses the link to the arduino connects again and
+ * carries on from the first row it doesn't know was written, up to
+ * RESUME_TRIES times.  How far it got is kept in the cache by port,
+ * image and erase mode (see journal()), so that if the loader gives up
+ * or is killed, the next load of the same image on that port can
+ * carry on too.  The arduino acknowledges a row before it writes it,
+ * so either way a CRC of program memory has to show the image is there
+ * before the load carries on, and the rows of the image from there on
+ * are erased again if the arduino can erase a row.  An incremental
+ * load needs none of this, as it skips the rows that are right anyway.
+ * With -e the words outside the image aren't known, so the CRC can't
+ * be had and a load that loses the link starts again, which only
+ * writes the image's words over themselves.
  */
-static void
-doit()
+#define	RESUME_TRIES	3
+#define	RECONNECT_MS	500	/* pause before connecting again, doubling */
+
+static unsigned long long
+image_hash()
+{
+	unsigned long long h;
+	int i;
+
+	h = 0xcbf29ce484222325ULL;	/* FNV-1a, a word at a time */
+	h = (h ^ erase_mode) * 0x100000001b3ULL;
+	for (i = 0; i < PIC_PROGRAM_WORDS; i++)
+		h = (h ^ image[i]) * 0x100000001b3ULL;
+	for (i = 0; i < PIC_CONFIG_WORDS; i++)
+		h = (h ^ (config_lines[i] ? config_image[i] : 0xffff)) *
+			0x100000001b3ULL;
+	for (i = 0; i < PIC_DATA_BYTES; i++)
+		h = (h ^ (data_lines[i] ? data_image[i] : 0xffff)) *
+			0x100000001b3ULL;
+	return h;
+}
+
+/*
+ * Does program memory hold the image below a?  Leaves the address at 0.
+ */
+static int
+loaded_to(int a)
 {
+	unsigned long crc[MAX_TARGETS];
+	unsigned long want;
 	int i;
+	int t;
+
+	if (a == 0)
+		return 1;
+	want = 0xffffffff;
+	for (i = 0; i < a; i++) {
+		want = crc32_update(want, image[i] & 0xff);
+		want = crc32_update(want, image[i] >> 8);
+	}
+	want = ~want & 0xffffffff;
+
+	crc_memory(0, a, crc);
+	queue_command(ResetAddress, 0);
+	for (t = 0; t < targets; t++)
+		if ((live & 1 << t) && crc[t] != want)
+			return 0;
+	return 1;
+}
+
+/*
+ * Where to carry on from, when the rows below a have been
+ * acknowledged.  The last of them may not have been written, so step
+ * back an erase row at a time until the image is all there.  Without
+ * CRC Words, or with -e, we can't tell, and start again.
+ */
+static int
+written_to(int a)
+{
+	if (!has_command(CRCWords) || keeping_memory())
+		return 0;
+	if (loaded_to(a))
+		return a;
+	a -= a % PIC_ERASE_ROW;
+	while (a > 0 && !loaded_to(a))
+		a -= PIC_ERASE_ROW;
+	return a;
+}
+
+/*
+ * Connect to the arduino on the same port again, after a pause that
+ * gets longer with each try.  Targets that have failed stay failed.
+ */
+static void
+reconnect(int tries)
+{
+	char port[sizeof port_path];
+	int was_live;
+
+	close(fd);
+	tx_niov = 0;
+	tx_used = 0;
+	tx_bytes = 0;
+	pending_first = 0;
+	pending_count = 0;
+	pending_bytes = 0;
+	retries = 0;
+	poll(NULL, 0, RECONNECT_MS << (tries - 1));
+
+	snprintf(port, sizeof port, "%s", port_path);
+	was_live = live;
+	openport(port);
+	live &= was_live;
+	enter_program_mode();
+}
+
+static void
+load_image()
+{
+	static int tries;
+	unsigned long long h;
+	char value[64];
+	int a;
+
+	if (plan_only) {
+		program_image();
+		return;
+	}
+
+	loaded = 0;
+	tries = 0;
+	journal_on = 0;
+	if (!incremental && !keeping_memory()) {
+		resume_hash = image_hash();
+		if (cache_get("resume", port_path, value, sizeof value) &&
+		    sscanf(value, "%llx/%x", &h, &a) == 2 &&
+		    h == resume_hash && a > 0)
+			loaded = written_to(a);
+		if (loaded > 0)
+			printf("Carrying on from %04x, where the last load "
+				"stopped\n", loaded);
+		journal(loaded);
+		journal_on = 1;
+	}
+
+	if (setjmp(link_lost)) {
+		loading = 0;
+		if (journal_on)
+			journal(loaded);
+		if (++tries > RESUME_TRIES) {
+			fprintf(stderr, "%s: giving up on %s\n",
+				myname, port_path);
+			exit(1);
+		}
+		reconnect(tries);
+		loading = 1;
+		loaded = written_to(loaded);
+		if (journal_on)
+			journal(loaded);
+		fprintf(stderr, "%s: connected again, carrying on from "
+				"%04x\n", myname, loaded);
+	}
+
+	loading = 1;
+	program_image();
+	loading = 0;
+	if (journal_on)
+		journal(-1);
+}
+
+/*
+ * Where the input has got to: in config space (1 after a C, 2 after
+ * an A) or not, and in data memory (after a D) or not.
+ */
+int input_config;
+int input_data;
+
+/*
+ * Deal with one input record: c is its letter and data its number.
+ */
+static void
+input_record(int c, int data, int lineno)
+{
+	switch(c) {
+	    case 'C':
+	    	
+		/* Enter config space programming mode */
+		input_config = 1;
+		input_data = 0;
+		flush_reads();
+		pic_address = 0;
+		skip_words = 0;
+		break;
+
+	    case 'A':
+	    	if (input_config != 1) {
+			fprintf(stderr, "%s: ilegal A record\n",
+				myname);
+			exit(1);
+		}
+		input_config = 2;
+		flush_reads();
+		pic_address = data;
+		break;
+	
+	    case 'D':
+		/* Data memory, from address data on */
+		input_config = 0;
+		input_data = 1;
+		flush_reads();
+		pic_address = data;
+		skip_words = 0;
+		break;
+
+	    case 'S':
+		flush_reads();
+		pic_address += data;
+		if (verbose)
+			printf("skipping %d words\n", data);
+		skip_words += data;
+		break;
+	
+	    case 'P':
+		/* A word for program memory */
+		if (input_data) {
+			/* Kept for plan_data(), and verify_data_memory() */
+			if (pic_address >= PIC_DATA_BYTES) {
+				fprintf(stderr, "%s: line %d is past "
+						"the end of data "
+						"memory\n",
+					myname, lineno);
+				exit(1);
+			}
+			data_image[pic_address] = data & 0xff;
+			data_lines[pic_address++] = lineno;
+			break;
+		}
+		if (input_config != 0) {
+			/* Kept for plan_config() and the config checks */
+			if (pic_address >= PIC_CONFIG_WORDS) {
+				fprintf(stderr, "%s: line %d is past "
+						"the end of config "
+						"memory\n",
+					myname, lineno);
+				exit(1);
+			}
+			config_image[pic_address] = data;
+			config_lines[pic_address++] = lineno;
+			break;
+		}
+		if (!verify || image_verify) {
+			if (pic_address >= PIC_PROGRAM_WORDS) {
+				fprintf(stderr, "%s: line %d is past "
+						"the end of program "
+						"memory\n",
+					myname, lineno);
+				exit(1);
+			}
+			image[pic_address] = data;
+			image_lines[pic_address++] = lineno;
+			break;
+		}
+		if (read_max() > 0) {
+			/* Read Words moves the address on. */
+			verify_data[words_to_verify] = data;
+			verify_lines[words_to_verify++] = lineno;
+			if (words_to_verify == read_max())
+				flush_reads();
+			pic_address++;
+			break;
+		}
+		catch_up();
+		queue_verify(ReadDatafromProgramMemory, data, lineno);
+		queue_command(IncrementAddress, 0);
+		pic_address++;
+		break;
+
+	    default:
+	    	fprintf(stderr, "%s: cannot understand input "
+				"command %c\n",
+			myname, c);
+		exit(1);
+	}
+}
+
+/*
+ * Read the text form of the input: P, S, C, A and D lines.
+ */
+static void
+read_text()
+{
 	int r;
-	int len;
 	int data;
-	int vdata;
 	int lineno;
-	int config;
-	int pic_number_of_latches;
 	char lbuf[128];
 
-	pic_address = 0;
 	lineno = 0;
-	config = 0;
-	data_in_latches = 0;
-	pic_number_of_latches = PIC_NUMBER_OF_LATCHES;
-
-	/*
-	 * Loop over lines of input.
-	 */
 	while(fgets(lbuf, sizeof lbuf, input) == lbuf) {
-		len = strlen(lbuf) - 1;
 		lineno++;
 
 		if (verbose)
@@ -408,89 +3597,236 @@ doit()
 				myname, r, lbuf);
 			exit(1);
 		}
+		input_record(lbuf[0], data, lineno);
+	}
+}
 
-		switch(lbuf[0]) {
-		    case 'C':
-		    	
-			/* Enter config space programming mode */
-			pic_number_of_latches = 1;
-			config = 1;
-			flush_latches();
-			pic_address = 0;
-			if (verify)
-				fprintf(stderr, "%s: Warning: cannot "
-						"verify config space.\n",
-					myname);
-			break;
+/*
+ * Where a run of words from an image got to: its space and the address
+ * after it.
+ */
+int run_space;
+unsigned long run_address;
 
-		    case 'A':
-		    	if (config != 1) {
-				fprintf(stderr, "%s: ilegal A record\n",
-					myname);
-				exit(1);
-			}
-			config = 2;
-			flush_latches();
-			pic_address = data;
-			break;
-		
-		/*
-		 * NOTE: this doesn't work.  Why???   *************
-		 */
-		    case 'S':
-			flush_latches();
-			pic_address += data;
+/*
+ * Start a run of words at address in space with the C, A, D or S
+ * record the text form would have had there.
+ */
+static void
+input_seek(int space, unsigned long address)
+{
+	if (space == run_space) {
+		if (address != run_address)
+			input_record('S', address - run_address, 0);
+	} else if (space == HEX_EEPROM) {
+		input_record('D', address, 0);
+		run_space = space;
+	} else {
+		input_record('C', 0, 0);
+		run_space = space;
+		if (address != 0)
+			input_record('A', address, 0);
+	}
+	run_address = address;
+}
+
+/*
+ * Read an Intel HEX file, with the same rules as hexcrack, and feed
+ * its words in.  Their lines are the lines of the HEX file.
+ */
+static void
+read_hex()
+{
+	struct hex_image im;
+	struct hex_parser p;
+	struct hex_segment *seg;
+	struct stat st;
+	char buf[8192];
+	size_t n;
+	int space;
+	int i;
+	int j;
+
+	hex_image_init(&im);
+	hex_parser_init(&p, &im);
+	if (fstat(fileno(input), &st) == 0 && S_ISREG(st.st_mode)) {
+		/* hex_read() maps it, from the start. */
+		if (hex_read(&p, fileno(input)) < 0)
+			goto fail;
+	} else {
+		while ((n = fread(buf, 1, sizeof buf, input)) > 0)
+			if (hex_parse(&p, buf, n) < 0)
+				goto fail;
+		if (hex_parse_end(&p) < 0)
+			goto fail;
+	}
+	for (space = 0; space < HEX_SPACES; space++)
+		for (i = 0; i < im.space[space].count; i++) {
 			if (verbose)
-				printf("skipping %d words\n", data);
-			while (data-- > 0)
-				send_command(IncrementAddress, 0);
-			break;
-		
-		    case 'P':
-			/* A word for program memory */
-			if (verify && config == 0) {
-				/* this code doesn't handle configuration */
-				vdata =
-				    send_command(ReadDatafromProgramMemory, 0);
-				if (vdata != data) {
-					fprintf(stderr, "%s: verify error on "
-							"line %d\n",
-						myname,
-						lineno);
-					if (verbose) {
-						fprintf(stderr, "\tExpected %x ",
-							data);
-						fprintf(stderr, "\t-- Got %x ",
-							vdata);
-					}
+				printf("Intel HEX, space %d, %d words at "
+						"%04lx\n",
+					space, im.space[space].segments[i].count,
+					im.space[space].segments[i].address);
+			seg = &im.space[space].segments[i];
+			input_seek(space, seg->address);
+			for (j = 0; j < seg->count; j++)
+				input_record('P', seg->words[j],
+					seg->lines[j]);
+			run_address += seg->count;
+		}
+	hex_image_free(&im);
+	return;
+
+    fail:
+	fprintf(stderr, "%s: %s\n", myname, p.error);
+	exit(1);
+}
+
+/*
+ * Read a binary image (see hexfile.h), mapped if it's a file.  Its
+ * words are fed in as the records the text form would have had; a
+ * word's "line" is its place in the image, counting from 1.
+ */
+static void
+read_binary()
+{
+	struct hex_bin_run run;
+	struct stat st;
+	unsigned long long hash;
+	unsigned char *data;
+	unsigned long i;
+	long size;
+	long alloc;
+	size_t n;
+	int segments;
+	int mapped;
+	int lineno;
+	int s;
+	char error[160];
+
+	mapped = 0;
+	if (fstat(fileno(input), &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			fileno(input), 0);
+		if (data != MAP_FAILED) {
+			mapped = 1;
+			size = st.st_size;
+		}
+	}
+	if (!mapped) {
+		data = NULL;
+		size = 0;
+		alloc = 0;
+		do {
+			if (size + 4096 > alloc) {
+				alloc = 2 * alloc + 4096;
+				data = realloc(data, alloc);
+				if (data == NULL) {
+					fprintf(stderr, "%s: out of memory\n",
+						myname);
 					exit(1);
 				}
-			} else if (!verify) {
-				if (config == 2 || config == 1) {
-					send_command(LoadConfiguration, data);
-					for (i = 0; i < pic_address; i++)
-						send_command(IncrementAddress,
-							0);
-					config = 3;
-				} else
-					send_command(LoadDataforProgramMemory,
-						data);
-				data_in_latches++;
-				if (data_in_latches >= pic_number_of_latches)
-					flush_latches();
 			}
-			send_command(IncrementAddress, 0);
-			pic_address++;
-			break;
+			n = fread(data + size, 1, alloc - size, input);
+			size += n;
+		} while (n > 0);
+	}
 
-		    default:
-		    	fprintf(stderr, "%s: cannot understand input "
-					"command %c\n",
-				myname, lbuf[0]);
-			exit(1);
-		}
+	segments = hex_bin_check(data, size, &hash, error);
+	if (segments < 0) {
+		fprintf(stderr, "%s: %s\n", myname, error);
+		exit(1);
+	}
+	if (verbose)
+		printf("Binary image, %d segments, hash %016llx\n",
+			segments, hash);
+
+	lineno = 0;
+	for (s = 0; s < segments; s++) {
+		hex_bin_segment(data, s, &run);
+		input_seek(run.space, run.address);
+		for (i = 0; i < run.count; i++)
+			input_record('P', run.words[2 * i] |
+				run.words[2 * i + 1] << 8, ++lineno);
+		run_address += run.count;
+	}
+
+	if (mapped)
+		munmap(data, size);
+	else
+		free(data);
+}
+
+/*
+ * Read the input: an Intel HEX file, a binary image or hexcrack's
+ * text, from FILE input.  The image is collected, except with -V
+ * when the words can be checked as they are read.
+ */
+static void
+read_input()
+{
+	int i;
+	int c;
+
+	pic_address = 0;
+	input_config = 0;
+	skip_words = 0;
+	words_to_verify = 0;
+	image_verify = verify && (nports > 1 || has_command(CRCWords));
+	for (i = 0; i < PIC_PROGRAM_WORDS; i++)
+		image[i] = BLANK_WORD;
+	memset(image_lines, 0, sizeof image_lines);
+	memset(config_lines, 0, sizeof config_lines);
+	memset(data_lines, 0, sizeof data_lines);
+	input_data = 0;
+
+	run_space = HEX_PROGRAM;
+	run_address = 0;
+	c = getc(input);
+	ungetc(c, input);
+	if (c == (HEX_BIN_MAGIC[0] & 0xff))
+		read_binary();
+	else if (c == ':')
+		read_hex();
+	else
+		read_text();
+
+	flush_reads();
+	drain_commands();
+}
+
+/*
+ * Program or verify the PIC from the image read_input() collected.
+ */
+static void
+use_image()
+{
+	if (image_verify)
+		verify_image();
+	if (verify) {
+		verify_config();
+		verify_data_memory();
+	} else
+		load_image();
+}
+
+/*
+ * Start programming the PIC.
+ *
+ * The Arduino is on fd.
+ */
+static void
+doit()
+{
+	/* Rewriting a row that changed means erasing it first */
+	if (incremental && !has_command(RowEraseProgramMemory)) {
+		fprintf(stderr, "%s: -i needs an arduino that can erase "
+				"a row\n", myname);
+		exit(1);
 	}
-	flush_latches();
+	read_input();
+	use_image();
 }
 
 /*
@@ -506,45 +3842,203 @@ erase()
 }
 
 /*
- * Done with programing.
+ * Done with programing.
+ */
+static void
+done()
+{
+	int c;
+
+	drain_commands();
+	c = send_control('x', 1);
+
+	if (c != '!') {
+		fprintf(stderr, "%s: expected \'!\', got: .%c.\n",
+			myname, c);
+		exit(1);
+	}
+}
+
+/*
+ * With several targets, say how each one did, and fail if any did.
+ */
+static void
+report_targets()
+{
+	int t;
+
+	if (targets == 1)
+		return;
+	for (t = 0; t < targets; t++)
+		printf("target %d: %s\n", t,
+			live & 1 << t ? "ok" : "FAILED");
+	if (live != (1 << targets) - 1)
+		exit(1);
+}
+
+static void
+post()
+{
+	if (run) {
+		send_control('R', 0);
+		sleep(2);
+		enter_program_mode();
+		do_print2();
+		if (serving)
+			done();
+	}
+	if (serving)
+		send_control('R', 0);	/* the PIC runs until the next job */
+	else
+		send_control('Z', 0);
+}
+
+/*
+ * Do what the arguments ask with the arduino, which is connected.
+ */
+static void
+session()
+{
+	live = (1 << targets) - 1;
+	enter_program_mode();
+
+	/* Loading erases as part of its plan. */
+	if (erase_mode == ERASE_ONLY)
+		erase();
+
+	if (print) {
+		if (print & PRINT_CONFIG)
+			do_print1();
+		print &= ~PRINT_CONFIG;
+		if (print & PRINT_PROGRAM)
+			do_print1();
+		if (print & PRINT_DATA)
+			do_print2();
+		if (print & PRINT_ALL)
+			do_dump();
+	} else if (erase_mode != ERASE_ONLY)
+		doit();
+
+	done();
+	post();
+
+	if (verbose)
+		printf("%ld reads, %ld writes, %ld polls\n",
+			io_reads, io_writes, io_polls);
+	report_targets();
+}
+
+/*
+ * Gang mode: with more than one -p, the input is read once and then
+ * loaded onto all the ports at the same time, by a child process per
+ * port.  A port that fails doesn't stop the others, and the result
+ * for each one is given when they're all done.
+ */
+
+/*
+ * Load the image onto the PIC on one port, in a child.
  */
 static void
-done()
+station(char *port)
 {
-	int c;
+	static char name[256];
 
-	write(fd, "x", 1);
+	snprintf(name, sizeof name, "%s: %s", myname, port);
+	myname = name;
+	setvbuf(stdout, NULL, _IOLBF, 0);
 
-	c = arduino_read();
-
-	if (c != '!') {
-		fprintf(stderr, "%s: expected \'!\', got: .%c.\n",
-			myname, c);
-		exit(1);
-	}
+	openport(port);
+	enter_program_mode();
+	if (erase_mode == ERASE_ONLY)
+		erase();
+	else
+		use_image();
+	done();
+	post();
+	report_targets();
+	exit(0);
 }
 
 static void
-post()
+gang()
 {
-	if (run) {
-		write(fd, "R", 1);
-		sleep(2);
-		enter_program_mode();
-		do_print2();
+	pid_t pids[MAX_PORTS];
+	int status[MAX_PORTS];
+	long ms[MAX_PORTS];
+	long start;
+	int running;
+	int failed;
+	int st;
+	pid_t pid;
+	int i;
+
+	if (erase_mode != ERASE_ONLY)
+		read_input();
+	fflush(stdout);
+
+	start = now_ms();
+	running = 0;
+	for (i = 0; i < nports; i++) {
+		status[i] = -1;
+		ms[i] = 0;
+		pids[i] = fork();
+		if (pids[i] == 0)
+			station(ports[i]);
+		if (pids[i] < 0)
+			fprintf(stderr, "%s: %s: cannot fork\n",
+				myname, ports[i]);
+		else
+			running++;
+	}
+
+	while (running > 0 && (pid = wait(&st)) > 0) {
+		for (i = 0; i < nports && pids[i] != pid; i++)
+			;
+		if (i == nports)
+			continue;
+		status[i] = st;
+		ms[i] = now_ms() - start;
+		running--;
+	}
+
+	failed = 0;
+	for (i = 0; i < nports; i++) {
+		if (status[i] != -1 && WIFEXITED(status[i]) &&
+		    WEXITSTATUS(status[i]) == 0)
+			printf("%s: ok in %ld.%ld s\n", ports[i],
+				ms[i] / 1000, ms[i] % 1000 / 100);
+		else {
+			printf("%s: FAILED\n", ports[i]);
+			failed++;
+		}
+	}
+	if (failed) {
+		printf("%d of %d ports failed\n", failed, nports);
+		exit(1);
 	}
-	write(fd, "Z", 1);
+	exit(0);
 }
 
 static void
 set_defaults()
 {
 	portname = NULL;
+	nports = 0;
+	serve_path = NULL;
+	client_path = NULL;
 	erase_mode = ERASE_NOT_SET;
 	verbose = 0;
 	verify = 0;
+	incremental = 0;
+	check = 1;
+	plan_only = 0;
 	print = 0;
 	run = 0;
+	stop_and_wait = 0;
+	ascii_only = 0;
+	max_baud = MAX_BAUD;
+	baud_given = 0;
+	no_reset = 0;
 }
 
 static void
@@ -552,17 +4046,35 @@ usage()
 {
 	set_defaults();
 
-	fprintf(stderr, "Usage: %s <options> [<hexfile>]\n", myname);
+	fprintf(stderr, "Usage: %s <options> [<file>]\n", myname);
+	fprintf(stderr, "The file is Intel HEX, or hexcrack's text or "
+			"binary output.\n");
 	fprintf(stderr, "Options:\n");
-	fprintf(stderr, "\t-p <com port>\n");
+	fprintf(stderr, "\t-p <com port> (more than one: load them "
+			"all at once)\n");
 	fprintf(stderr, "\t-e (do NOT erase before loading)\n");
 	fprintf(stderr, "\t-E (erase only, no loading)\n");
 	fprintf(stderr, "\t-V (verify only, no erase, no programming)\n");
+	fprintf(stderr, "\t-i (incremental, rewrite only the rows, data "
+			"bytes and config words that changed)\n");
+	fprintf(stderr, "\t-c (do NOT check each row after writing it)\n");
+	fprintf(stderr, "\t-N (print what loading would send, "
+			"without an arduino)\n");
 	fprintf(stderr, "\t-v (verbose mode)\n");
 	fprintf(stderr, "\t-C (print out config space)\n");
 	fprintf(stderr, "\t-P (print out a bit program space)\n");
 	fprintf(stderr, "\t-D (print out a bit data space)\n");
+	fprintf(stderr, "\t-M (print out all of memory)\n");
 	fprintf(stderr, "\t-r (run program, wait 2 seconds, print data)\n");
+	fprintf(stderr, "\t-S (stop and wait, one command at a time)\n");
+	fprintf(stderr, "\t-a (ASCII protocol only, no binary frames)\n");
+	fprintf(stderr, "\t-b <baud> (fastest baud rate to try, default %d)\n",
+		MAX_BAUD);
+	fprintf(stderr, "\t-n (don't reset the arduino when opening the port)\n");
+	fprintf(stderr, "\t-d <socket> (daemon: keep the ports open, run "
+			"the jobs sent to socket)\n");
+	fprintf(stderr, "\t-s <socket> (send the job to the daemon on socket, "
+			"default $PICLOADER_SOCKET)\n");
 	exit(1);
 }
 
@@ -577,8 +4089,9 @@ grok_args(int argc, char **argv)
 
 	myname = argv[0];
 	errors = 0;
+	set_defaults();
 
-	while ((c = getopt(argc, argv, "rDPCVeEp:vh")) != EOF)
+	while ((c = getopt(argc, argv, "rDPCMVicNeEp:vSab:nd:s:h")) != EOF)
 	switch (c) {
 
 	    case 'r':
@@ -597,10 +4110,26 @@ grok_args(int argc, char **argv)
 	    	print |= PRINT_CONFIG;
 		break;
 
+	    case 'M':
+	    	print |= PRINT_ALL;
+		break;
+
 	    case 'V':
 	    	verify++;
 		break;
 
+	    case 'i':
+	    	incremental++;
+		break;
+
+	    case 'c':
+	    	check = 0;
+		break;
+
+	    case 'N':
+	    	plan_only++;
+		break;
+
 	    case 'e':
 	    	erase_mode = ERASE_NOT;
 		break;
@@ -611,12 +4140,48 @@ grok_args(int argc, char **argv)
 
 	    case 'p':
 	    	portname = optarg;
+		if (nports == MAX_PORTS) {
+			fprintf(stderr, "%s: no more than %d ports\n",
+				myname, MAX_PORTS);
+			errors++;
+		} else
+			ports[nports++] = optarg;
 		break;
 
 	    case 'v':
 	    	verbose++;
 		break;
 
+	    case 'S':
+	    	stop_and_wait++;
+		break;
+
+	    case 'a':
+	    	ascii_only++;
+		break;
+
+	    case 'b':
+	    	max_baud = atoi(optarg);
+		baud_given = 1;
+		if (max_baud < BAUD) {
+			fprintf(stderr, "%s: baud rate must be at least %d\n",
+				myname, BAUD);
+			errors++;
+		}
+		break;
+
+	    case 'n':
+	    	no_reset++;
+		break;
+
+	    case 'd':
+	    	serve_path = optarg;
+		break;
+
+	    case 's':
+	    	client_path = optarg;
+		break;
+
 	    case 'h':
 	    case '?':
 	    default:
@@ -624,13 +4189,60 @@ grok_args(int argc, char **argv)
 	}
 
 	if (print && erase_mode != ERASE_NOT_SET) {
-		fprintf(stderr, "%s: -D/-P/-C not compatible with -e or -E\n",
+		fprintf(stderr, "%s: -D/-P/-C/-M not compatible with -e or -E\n",
+			myname);
+		errors++;
+	}
+
+	if (incremental && (print || verify ||
+	    erase_mode != ERASE_NOT_SET)) {
+		fprintf(stderr, "%s: -i not compatible with -D/-P/-C/-M, "
+				"-V, -e or -E\n",
+			myname);
+		errors++;
+	}
+
+	if (!check && (print || verify || erase_mode == ERASE_ONLY)) {
+		fprintf(stderr, "%s: -c not compatible with -D/-P/-C/-M, "
+				"-V or -E\n",
+			myname);
+		errors++;
+	}
+
+	if (plan_only && (print || verify || incremental ||
+	    erase_mode == ERASE_ONLY)) {
+		fprintf(stderr, "%s: -N not compatible with -D/-P/-C/-M, "
+				"-V, -i or -E\n",
+			myname);
+		errors++;
+	}
+
+	if (serve_path && (client_path || print || verify || incremental ||
+	    !check || plan_only || run || erase_mode != ERASE_NOT_SET ||
+	    optind < argc)) {
+		fprintf(stderr, "%s: -d takes no job options and no file\n",
+			myname);
+		errors++;
+	}
+
+	if (client_path == NULL && serve_path == NULL && !plan_only)
+		client_path = getenv("PICLOADER_SOCKET");
+	if (client_path && (nports > 1 || plan_only)) {
+		fprintf(stderr, "%s: only one -p and no -N with -s\n",
+			myname);
+		errors++;
+	}
+	job_argc = optind;
+	job_argv = argv;
+
+	if (nports > 1 && (print || plan_only)) {
+		fprintf(stderr, "%s: only one -p with -D/-P/-C/-M or -N\n",
 			myname);
 		errors++;
 	}
 
 	if (erase_mode == ERASE_NOT_SET) {
-		if (print || verify)
+		if (print || verify || incremental)
 			erase_mode = ERASE_NOT;
 		else
 			erase_mode = ERASE_AND_LOAD;
@@ -641,7 +4253,7 @@ grok_args(int argc, char **argv)
 	}
 
 	if (print && verify) {
-		fprintf(stderr, "%s: only one of -D/-P/-C and -V permitted.\n",
+		fprintf(stderr, "%s: only one of -D/-P/-C/-M and -V permitted.\n",
 			myname);
 		errors++;
 	}
@@ -649,7 +4261,7 @@ grok_args(int argc, char **argv)
 	nargs = argc - optind;
 
 	if (nargs > 0 && print) {
-		fprintf(stderr, "%s: no opt args when -D/-P/-C\n", myname);
+		fprintf(stderr, "%s: no opt args when -D/-P/-C/-M\n", myname);
 		errors++;
 	}
 
@@ -676,31 +4288,512 @@ grok_args(int argc, char **argv)
 		usage();
 }
 
-int
-main(int argc, char **argv)
+/*
+ * Daemon mode, -d socket.  A worker process for each port opens it
+ * and handshakes once, then runs the jobs sent to it one at a time,
+ * so back to back jobs don't reset the arduino or handshake again.
+ * Jobs wait their turn in the worker's socket.  A job that fails
+ * leaves the link in doubt, so the worker connects again before the
+ * next one.
+ *
+ * With -s socket, or PICLOADER_SOCKET in the environment, the loader
+ * is the client.  It checks its arguments and passes them to the
+ * daemon along with the input, stdout and stderr, and exits with the
+ * job's status.  The job runs in a child of the worker, which reads
+ * the arguments as the loader would, so any job the loader can do
+ * the daemon can too.
+ *
+ * A job is one message: the port name, or "" for the first port, and
+ * the arguments, each ending in a NUL, with the descriptors.  The
+ * answer is a byte, the job's exit status.
+ *
+ * The socket is only for its owner, and root.  Clients that connect
+ * wait in a poll until their job comes, so one that says nothing
+ * doesn't hold up the others.
+ */
+#define	JOB_MAX		4096
+#define	JOB_FDS		4	/* input, stdout, stderr, the client */
+#define	CLIENTS_MAX	16	/* connected, job not yet sent */
+#define	CLIENT_WAIT_MS	2000	/* for a client that says nothing */
+
+struct worker {
+	char *port;
+	int sock;		/* jobs go in here */
+	pid_t pid;
+} workers[MAX_PORTS];
+int nworkers;
+int listener;
+
+static int
+send_job(int s, char *buf, int len, int *fds, int nfds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(JOB_FDS * sizeof(int))];
+	} control;
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+	return sendmsg(s, &msg, 0) == len ? 0 : -1;
+}
+
+/*
+ * Receive a job into buf, which has room for JOB_MAX bytes and a NUL.
+ * Returns its length, 0 at end of file, or -1.
+ */
+static int
+recv_job(int s, char *buf, int *fds, int *nfds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(JOB_FDS * sizeof(int))];
+	} control;
+	int len;
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = buf;
+	iov.iov_len = JOB_MAX;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof control.buf;
+	len = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+	*nfds = 0;
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+		}
+	return len;
+}
+
+static void
+close_fds(int *fds, int n)
+{
+	while (n > 0)
+		close(fds[--n]);
+}
+
+/*
+ * Put in dev the device that openport() takes a port name to mean:
+ * the name itself if there is such a file, or else gen_name() of it.
+ */
+static void
+port_device(char *name, char *dev)
+{
+	if (access(name, F_OK) != 0)
+		name = gen_name(name);
+	if (realpath(name, dev) == NULL)
+		snprintf(dev, PATH_MAX, "%s", name);
+}
+
+/*
+ * Do two port names mean the same device?  "10" and "/dev/ttyS10" do.
+ */
+static int
+same_port(char *a, char *b)
 {
+	char da[PATH_MAX];
+	char db[PATH_MAX];
+
+	port_device(a, da);
+	port_device(b, db);
+	return strcmp(da, db) == 0;
+}
+
+/*
+ * Run a job, in a child of the worker.  Tell the worker on done where
+ * the link was left.
+ */
+static void
+job(char *buf, int len, int *fds, int done)
+{
+	char *argv[JOB_MAX / 2 + 1];
+	int argc;
+	char *p;
+	int ascii;		/* the daemon's own -a, -b and -n */
+	int baud;
+	int stay;
+
+	argc = 0;
+	for (p = buf + strlen(buf) + 1; p < buf + len; p += strlen(p) + 1)
+		argv[argc++] = p;
+	argv[argc] = NULL;
+
+	dup2(fds[0], 0);
+	dup2(fds[1], 1);
+	dup2(fds[2], 2);
+	close_fds(fds, JOB_FDS);
+	signal(SIGPIPE, SIG_DFL);
+
+	/* A daemon that found its port itself takes jobs for any port */
+	if (buf[0] != '\0' && !same_port(buf, port_path)) {
+		fprintf(stderr, "%s: the daemon is on %s, not %s\n",
+			myname, port_path, buf);
+		write(done, &tx_seq, sizeof tx_seq);
+		exit(1);
+	}
+
+	ascii = ascii_only;
+	baud = max_baud;
+	stay = no_reset;
+	optind = 1;
 	grok_args(argc, argv);
+	client_path = NULL;
+	if (ascii_only || baud_given || no_reset) {
+		fprintf(stderr, "%s: -a, -b and -n are for the daemon, "
+				"the link is already up\n", myname);
+		write(done, &tx_seq, sizeof tx_seq);
+		exit(1);
+	}
+	ascii_only = ascii;
+	max_baud = baud;
+	no_reset = stay;
+	if (window == 0)
+		stop_and_wait = 1;
 
-	openport(portname);
+	session();
+	write(done, &tx_seq, sizeof tx_seq);
+	exit(0);
+}
 
-	enter_program_mode();
+/*
+ * Hold the port open and run the jobs that come in on s.
+ */
+static void
+work(char *port, int s)
+{
+	char buf[JOB_MAX + 1];
+	int fds[JOB_FDS];
+	int nfds;
+	int len;
+	int pipefd[2];
+	int seq;
+	int st;
+	char status;
+	pid_t pid;
 
-	if (erase_mode != ERASE_NOT)
-		erase();
+	serving = 1;
+	openport(port);
+	if (verbose)
+		printf("%s: serving %s\n", myname, port_path);
+	fflush(stdout);
 
-	if (print) {
-		if (print & PRINT_CONFIG)
-			do_print1();
-		print &= ~PRINT_CONFIG;
-		if (print & PRINT_PROGRAM)
-			do_print1();
-		if (print & PRINT_DATA)
-			do_print2();
-	} else if (erase_mode != ERASE_ONLY)
-		doit();
+	for (;;) {
+		len = recv_job(s, buf, fds, &nfds);
+		if (len == 0)
+			exit(0);		/* the daemon is gone */
+		if (len < 0 || nfds != JOB_FDS) {
+			close_fds(fds, nfds);
+			continue;
+		}
+		if (fd < 0)
+			openport(port);
 
-	done();
-	post();
+		if (pipe(pipefd) < 0) {
+			fprintf(stderr, "%s: cannot make a pipe\n", myname);
+			exit(1);
+		}
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) {
+			close(pipefd[0]);
+			job(buf, len, fds, pipefd[1]);
+		}
+		close(pipefd[1]);
+
+		st = 1 << 8;
+		if (pid > 0)
+			waitpid(pid, &st, 0);
+		status = WIFEXITED(st) ? WEXITSTATUS(st) : 1;
+		if (read(pipefd[0], &seq, sizeof seq) == sizeof seq)
+			tx_seq = seq;
+		else {
+			close(fd);		/* connect again */
+			fd = -1;
+		}
+		close(pipefd[0]);
+
+		write(fds[3], &status, 1);
+		close_fds(fds, JOB_FDS);
+	}
+}
+
+static void
+start_worker(struct worker *w)
+{
+	int sv[2];
+	int i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		fprintf(stderr, "%s: cannot make a socket pair\n", myname);
+		exit(1);
+	}
+	fflush(stdout);
+	w->pid = fork();
+	if (w->pid == 0) {
+		close(listener);
+		for (i = 0; i < nworkers; i++)
+			if (workers[i].sock >= 0)
+				close(workers[i].sock);
+		close(sv[0]);
+		work(w->port, sv[1]);
+	}
+	close(sv[1]);
+	w->sock = sv[0];
+}
+
+/*
+ * Is the client on c the daemon's owner, or root?
+ */
+static int
+peer_ok(int c)
+{
+	struct ucred cred;
+	socklen_t len;
+
+	len = sizeof cred;
+	if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return 0;
+	return cred.uid == 0 || cred.uid == getuid();
+}
+
+/*
+ * Pass the job waiting on client c to its port's worker.
+ */
+static void
+take_job(int c)
+{
+	struct worker *w;
+	char buf[JOB_MAX + 1];
+	int fds[JOB_FDS];
+	int nfds;
+	int len;
+	int i;
+	char status;
 
+	len = recv_job(c, buf, fds, &nfds);
+	if (len <= 0 || nfds != JOB_FDS - 1) {
+		close_fds(fds, nfds);
+		close(c);
+		return;
+	}
+
+	w = NULL;
+	for (i = 0; i < nworkers && w == NULL; i++)
+		if (buf[0] == '\0' || (workers[i].port &&
+		    same_port(buf, workers[i].port)))
+			w = &workers[i];
+	if (w == NULL && workers[0].port == NULL)
+		w = &workers[0];	/* it checks the port itself */
+	if (w && waitpid(w->pid, NULL, WNOHANG) == w->pid) {
+		close(w->sock);
+		start_worker(w);
+	}
+
+	fds[JOB_FDS - 1] = c;
+	if (w == NULL || send_job(w->sock, buf, len, fds, JOB_FDS) < 0) {
+		dprintf(fds[2], "%s: no port %s in the daemon\n",
+			myname, buf);
+		status = 1;
+		write(c, &status, 1);
+	}
+	close_fds(fds, JOB_FDS);
+	if (verbose)
+		printf("job for %s\n", buf[0] ? buf : "the first port");
+	fflush(stdout);
+}
+
+/*
+ * The daemon: take jobs from the socket and pass each one to the
+ * worker for its port, starting the worker again if it has died.
+ */
+static void
+serve()
+{
+	struct sockaddr_un sa;
+	struct pollfd pfd[1 + CLIENTS_MAX];
+	int clients[CLIENTS_MAX];
+	long since[CLIENTS_MAX];
+	int nclients;
+	mode_t mask;
+	long now;
+	int wait;
+	int polled;
+	int c;
+	int i;
+	int r;
+
+	signal(SIGPIPE, SIG_IGN);	/* clients that go away */
+	listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof sa.sun_path, "%s", serve_path);
+	unlink(serve_path);
+	mask = umask(0077);
+	r = listener < 0 ||
+	    bind(listener, (struct sockaddr *)&sa, sizeof sa) < 0 ||
+	    listen(listener, 16) < 0;
+	umask(mask);
+	if (r) {
+		fprintf(stderr, "%s: cannot listen on %s\n",
+			myname, serve_path);
+		exit(1);
+	}
+
+	nworkers = nports > 0 ? nports : 1;
+	for (i = 0; i < nworkers; i++) {
+		workers[i].port = nports > 0 ? ports[i] : NULL;
+		workers[i].sock = -1;
+	}
+	for (i = 0; i < nworkers; i++)
+		start_worker(&workers[i]);
+
+	nclients = 0;
+	for (;;) {
+		now = now_ms();
+		wait = -1;
+		for (i = nclients - 1; i >= 0; i--) {
+			if (now - since[i] >= CLIENT_WAIT_MS) {
+				close(clients[i]);
+				nclients--;
+				clients[i] = clients[nclients];
+				since[i] = since[nclients];
+				continue;
+			}
+			if (wait < 0 || since[i] + CLIENT_WAIT_MS - now < wait)
+				wait = since[i] + CLIENT_WAIT_MS - now;
+		}
+		pfd[0].fd = listener;
+		pfd[0].events = nclients < CLIENTS_MAX ? POLLIN : 0;
+		for (i = 0; i < nclients; i++) {
+			pfd[1 + i].fd = clients[i];
+			pfd[1 + i].events = POLLIN;
+		}
+		polled = nclients;
+		if (poll(pfd, 1 + polled, wait) < 1)
+			continue;
+
+		/* Last first, as each one taken moves the last one down */
+		for (i = polled - 1; i >= 0; i--) {
+			if (pfd[1 + i].revents == 0)
+				continue;
+			c = clients[i];
+			nclients--;
+			clients[i] = clients[nclients];
+			since[i] = since[nclients];
+			take_job(c);
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			c = accept(listener, NULL, NULL);
+			if (c < 0)
+				continue;
+			if (!peer_ok(c)) {
+				close(c);
+				continue;
+			}
+			clients[nclients] = c;
+			since[nclients] = now_ms();
+			nclients++;
+		}
+	}
+}
+
+/*
+ * Send the job to the daemon and wait for it.
+ */
+static void
+client()
+{
+	struct sockaddr_un sa;
+	char buf[JOB_MAX];
+	int fds[JOB_FDS - 1];
+	int len;
+	int n;
+	int i;
+	int s;
+	char status;
+
+	len = snprintf(buf, sizeof buf, "%s", portname ? portname : "") + 1;
+	for (i = 0; i < job_argc; i++) {
+		n = strlen(job_argv[i]) + 1;
+		if (len + n > JOB_MAX) {
+			fprintf(stderr, "%s: too many arguments\n", myname);
+			exit(1);
+		}
+		memcpy(buf + len, job_argv[i], n);
+		len += n;
+	}
+
+	s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof sa.sun_path, "%s", client_path);
+	if (s < 0 || connect(s, (struct sockaddr *)&sa, sizeof sa) < 0) {
+		fprintf(stderr, "%s: no daemon on %s\n", myname, client_path);
+		exit(1);
+	}
+
+	fds[0] = fileno(input);
+	fds[1] = 1;
+	fds[2] = 2;
+	fflush(stdout);
+	if (send_job(s, buf, len, fds, JOB_FDS - 1) < 0) {
+		fprintf(stderr, "%s: cannot send the job to %s\n",
+			myname, client_path);
+		exit(1);
+	}
+	if (read(s, &status, 1) != 1) {
+		fprintf(stderr, "%s: the daemon dropped the job\n", myname);
+		exit(1);
+	}
+	exit(status);
+}
+
+int
+main(int argc, char **argv)
+{
+	grok_args(argc, argv);
+	targets = 1;		/* until a handshake says */
+	live = 1;
+
+	if (serve_path)
+		serve();
+	if (client_path)
+		client();
+	if (nports > 1)
+		gang();
+
+	if (plan_only) {
+		strcpy(capabilities, PLAN_CAPABILITIES);
+		window = capability_value('W');
+		framed = !ascii_only;
+		doit();
+		exit(0);
+	}
+
+	openport(portname);
+	session();
 	exit(0);
 }